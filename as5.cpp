@@ -2,7 +2,33 @@
 #include <string>
 #include <vector>
 #include <fstream>
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <cstdint>
+#include <charconv>
 #include <functional>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <type_traits>
+#include <unordered_set>
+#include <unordered_map>
+#include <mutex>
+#include <memory>
+#ifdef __linux__
+#include <malloc.h>
+#endif
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
@@ -25,6 +51,25 @@
 #define TOP_FRONT_RIGHT		64
 #define TOP_FRONT_LEFT		128
 
+// Corner bits in the order used by cornerOffsets
+const int cornerBits[8] = {
+	BOTTOM_BACK_LEFT, BOTTOM_BACK_RIGHT, BOTTOM_FRONT_RIGHT, BOTTOM_FRONT_LEFT,
+	TOP_BACK_LEFT, TOP_BACK_RIGHT, TOP_FRONT_RIGHT, TOP_FRONT_LEFT
+};
+
+// X, Y, Z grid offset of each corner from the cube's origin
+const int cornerOffsets[8][3] = {
+	{0, 0, 0}, {1, 0, 0}, {1, 0, 1}, {0, 0, 1},
+	{0, 1, 0}, {1, 1, 0}, {1, 1, 1}, {0, 1, 1}
+};
+
+// Corners at the two ends of each cube edge (numbered as in cornerOffsets, edges as in vertTable), lower coordinate first
+const int edgeCorners[12][2] = {
+	{0, 1}, {1, 2}, {3, 2}, {0, 3},
+	{4, 5}, {5, 6}, {7, 6}, {4, 7},
+	{0, 4}, {1, 5}, {2, 6}, {3, 7}
+};
+
 // Function that generates the surface
 float f(float x, float y, float z){
 	//return y - (sin(x) * cos(z));		// Example 1 from assignment instructions (wavy surface)
@@ -32,25 +77,869 @@ float f(float x, float y, float z){
 	return x * x + y * y + z * z;		// Draws a sphere with radius = isoval
 }
 
+// Calls f() through a type the compiler knows, so f() can be inlined into the marching cubes loops
+struct SurfaceFunction{
+	float operator()(float x, float y, float z) const{
+		return f(x, y, z);
+	}
+};
+
+// Any generation function. Calls go through std::function, so they can't be inlined.
+typedef std::function<float(float, float, float)> GenericFunction;
+
+// A batch of floats processed together with SIMD instructions: 8 with AVX2, 4 with SSE2, otherwise 1 (plain floats).
+// Compile with -mavx2 (or -march=native) to get the 8-wide version; x86-64 always has SSE2.
+// Comparisons return a mask batch, which storeMask() turns into 0xFF (true) or 0 (false) bytes.
+#if defined(__AVX2__)
+struct FloatBatch{
+	static const int WIDTH = 8;
+	__m256 v;
+
+	FloatBatch(){}
+	FloatBatch(__m256 value) : v(value) {}
+	FloatBatch(float value) : v(_mm256_set1_ps(value)) {}
+
+	static FloatBatch load(const float* p){ return _mm256_loadu_ps(p); }
+	void store(float* p) const{ _mm256_storeu_ps(p, v); }
+	void storeMask(uint8_t* p) const{
+		__m128i words = _mm_packs_epi32(_mm256_castsi256_si128(_mm256_castps_si256(v)), _mm256_extractf128_si256(_mm256_castps_si256(v), 1));
+		_mm_storel_epi64((__m128i*)p, _mm_packs_epi16(words, words));
+	}
+};
+inline FloatBatch operator+(FloatBatch a, FloatBatch b){ return _mm256_add_ps(a.v, b.v); }
+inline FloatBatch operator-(FloatBatch a, FloatBatch b){ return _mm256_sub_ps(a.v, b.v); }
+inline FloatBatch operator*(FloatBatch a, FloatBatch b){ return _mm256_mul_ps(a.v, b.v); }
+inline FloatBatch operator/(FloatBatch a, FloatBatch b){ return _mm256_div_ps(a.v, b.v); }
+inline FloatBatch sqrt(FloatBatch a){ return _mm256_sqrt_ps(a.v); }
+inline FloatBatch abs(FloatBatch a){ return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a.v); }
+inline FloatBatch min(FloatBatch a, FloatBatch b){ return _mm256_min_ps(a.v, b.v); }
+inline FloatBatch max(FloatBatch a, FloatBatch b){ return _mm256_max_ps(a.v, b.v); }
+inline FloatBatch round(FloatBatch a){ return _mm256_round_ps(a.v, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC); }
+inline FloatBatch operator<(FloatBatch a, FloatBatch b){ return _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ); }
+inline FloatBatch operator<=(FloatBatch a, FloatBatch b){ return _mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ); }
+inline FloatBatch operator>(FloatBatch a, FloatBatch b){ return _mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ); }
+inline FloatBatch operator>=(FloatBatch a, FloatBatch b){ return _mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ); }
+#elif defined(__SSE2__)
+struct FloatBatch{
+	static const int WIDTH = 4;
+	__m128 v;
+
+	FloatBatch(){}
+	FloatBatch(__m128 value) : v(value) {}
+	FloatBatch(float value) : v(_mm_set1_ps(value)) {}
+
+	static FloatBatch load(const float* p){ return _mm_loadu_ps(p); }
+	void store(float* p) const{ _mm_storeu_ps(p, v); }
+	void storeMask(uint8_t* p) const{
+		__m128i words = _mm_packs_epi32(_mm_castps_si128(v), _mm_castps_si128(v));
+		int bytes = _mm_cvtsi128_si32(_mm_packs_epi16(words, words));
+		memcpy(p, &bytes, 4);
+	}
+};
+inline FloatBatch operator+(FloatBatch a, FloatBatch b){ return _mm_add_ps(a.v, b.v); }
+inline FloatBatch operator-(FloatBatch a, FloatBatch b){ return _mm_sub_ps(a.v, b.v); }
+inline FloatBatch operator*(FloatBatch a, FloatBatch b){ return _mm_mul_ps(a.v, b.v); }
+inline FloatBatch operator/(FloatBatch a, FloatBatch b){ return _mm_div_ps(a.v, b.v); }
+inline FloatBatch sqrt(FloatBatch a){ return _mm_sqrt_ps(a.v); }
+inline FloatBatch abs(FloatBatch a){ return _mm_andnot_ps(_mm_set1_ps(-0.0f), a.v); }
+inline FloatBatch min(FloatBatch a, FloatBatch b){ return _mm_min_ps(a.v, b.v); }
+inline FloatBatch max(FloatBatch a, FloatBatch b){ return _mm_max_ps(a.v, b.v); }
+inline FloatBatch round(FloatBatch a){ return _mm_cvtepi32_ps(_mm_cvtps_epi32(a.v)); }	// Only for values that fit in an int
+inline FloatBatch operator<(FloatBatch a, FloatBatch b){ return _mm_cmplt_ps(a.v, b.v); }
+inline FloatBatch operator<=(FloatBatch a, FloatBatch b){ return _mm_cmple_ps(a.v, b.v); }
+inline FloatBatch operator>(FloatBatch a, FloatBatch b){ return _mm_cmpgt_ps(a.v, b.v); }
+inline FloatBatch operator>=(FloatBatch a, FloatBatch b){ return _mm_cmpge_ps(a.v, b.v); }
+#else
+struct FloatBatch{
+	static const int WIDTH = 1;
+	float v;
+
+	FloatBatch(){}
+	FloatBatch(float value) : v(value) {}
+
+	static FloatBatch load(const float* p){ return *p; }
+	void store(float* p) const{ *p = v; }
+	void storeMask(uint8_t* p) const{ *p = v != 0 ? 0xFF : 0; }
+};
+inline FloatBatch operator+(FloatBatch a, FloatBatch b){ return a.v + b.v; }
+inline FloatBatch operator-(FloatBatch a, FloatBatch b){ return a.v - b.v; }
+inline FloatBatch operator*(FloatBatch a, FloatBatch b){ return a.v * b.v; }
+inline FloatBatch operator/(FloatBatch a, FloatBatch b){ return a.v / b.v; }
+inline FloatBatch sqrt(FloatBatch a){ return std::sqrt(a.v); }
+inline FloatBatch abs(FloatBatch a){ return std::abs(a.v); }
+inline FloatBatch min(FloatBatch a, FloatBatch b){ return std::min(a.v, b.v); }
+inline FloatBatch max(FloatBatch a, FloatBatch b){ return std::max(a.v, b.v); }
+inline FloatBatch round(FloatBatch a){ return std::nearbyint(a.v); }
+inline FloatBatch operator<(FloatBatch a, FloatBatch b){ return a.v < b.v ? 1.0f : 0.0f; }
+inline FloatBatch operator<=(FloatBatch a, FloatBatch b){ return a.v <= b.v ? 1.0f : 0.0f; }
+inline FloatBatch operator>(FloatBatch a, FloatBatch b){ return a.v > b.v ? 1.0f : 0.0f; }
+inline FloatBatch operator>=(FloatBatch a, FloatBatch b){ return a.v >= b.v ? 1.0f : 0.0f; }
+#endif
+
+// Sine of a batch, accurate to about 1e-7 for angles up to a few thousand radians.
+// The angle is brought into [-pi/2, pi/2] (using sin(x) = sin(pi - x)) and then put through the Taylor series up to x^11.
+inline FloatBatch sin(FloatBatch x){
+	const float PI = 3.14159265358979f;
+	x = x - round(x * (0.5f / PI)) * (2 * PI);	// Now in [-pi, pi]
+	x = min(x, FloatBatch(PI) - x);
+	x = max(x, FloatBatch(-PI) - x);
+	FloatBatch x2 = x * x;
+	FloatBatch series = FloatBatch(-1.0f / 39916800) * x2 + 1.0f / 362880;
+	series = series * x2 - 1.0f / 5040;
+	series = series * x2 + 1.0f / 120;
+	series = series * x2 - 1.0f / 6;
+	return x + x * x2 * series;
+}
+
+inline FloatBatch cos(FloatBatch x){
+	return sin(x + 1.57079632679490f);
+}
+
+// Builds the case index of each cube in a row from the inside masks (0xFF or 0 bytes) of its 8 corners:
+// cases[i] gets cornerBits[c] for every corner c where corners[c][i] is set
+void buildCases(const uint8_t* const corners[8], uint8_t* cases, int count){
+	int i = 0;
+#if defined(__AVX2__)
+	for (; i + 32 <= count; i += 32){
+		__m256i index = _mm256_setzero_si256();
+		for (int c = 0; c < 8; c++){
+			__m256i inside = _mm256_loadu_si256((const __m256i*)(corners[c] + i));
+			index = _mm256_or_si256(index, _mm256_and_si256(inside, _mm256_set1_epi8(cornerBits[c])));
+		}
+		_mm256_storeu_si256((__m256i*)(cases + i), index);
+	}
+#endif
+#if defined(__SSE2__)
+	for (; i + 16 <= count; i += 16){
+		__m128i index = _mm_setzero_si128();
+		for (int c = 0; c < 8; c++){
+			__m128i inside = _mm_loadu_si128((const __m128i*)(corners[c] + i));
+			index = _mm_or_si128(index, _mm_and_si128(inside, _mm_set1_epi8(cornerBits[c])));
+		}
+		_mm_storeu_si128((__m128i*)(cases + i), index);
+	}
+#endif
+	for (; i < count; i++){
+		uint8_t index = 0;
+		for (int c = 0; c < 8; c++){
+			index |= corners[c][i] & cornerBits[c];
+		}
+		cases[i] = index;
+	}
+}
+
+// Range of values [lo, hi]. Calling a function with Intervals gives bounds on its value over a box (interval arithmetic),
+// which is used to skip parts of the volume the surface can't pass through.
+struct Interval{
+	float lo, hi;
+
+	Interval(){}
+	Interval(float value) : lo(value), hi(value) {}
+	Interval(float low, float high) : lo(low), hi(high) {}
+};
+inline Interval operator+(Interval a, Interval b){ return Interval(a.lo + b.lo, a.hi + b.hi); }
+inline Interval operator-(Interval a, Interval b){ return Interval(a.lo - b.hi, a.hi - b.lo); }
+// An end of 0 times an unbounded end is 0 rather than NaN: the unbounded end stands for finite values of any size
+inline float boundProduct(float a, float b){
+	return a == 0 || b == 0 ? 0 : a * b;
+}
+inline Interval operator*(Interval a, Interval b){
+	float products[4] = {boundProduct(a.lo, b.lo), boundProduct(a.lo, b.hi), boundProduct(a.hi, b.lo), boundProduct(a.hi, b.hi)};
+	return Interval(*std::min_element(products, products + 4), *std::max_element(products, products + 4));
+}
+// Dividing by a range containing 0 could give anything
+inline Interval operator/(Interval a, Interval b){
+	if (b.lo <= 0 && b.hi >= 0) return Interval(-INFINITY, INFINITY);
+	return a * Interval(1 / b.hi, 1 / b.lo);
+}
+inline Interval min(Interval a, Interval b){ return Interval(std::min(a.lo, b.lo), std::min(a.hi, b.hi)); }
+inline Interval max(Interval a, Interval b){ return Interval(std::max(a.lo, b.lo), std::max(a.hi, b.hi)); }
+inline Interval abs(Interval a){
+	if (a.lo >= 0) return a;
+	if (a.hi <= 0) return Interval(-a.hi, -a.lo);
+	return Interval(0, std::max(-a.lo, a.hi));
+}
+// a * a is never negative, which a * a as two independent ranges doesn't know
+inline Interval square(Interval a){
+	Interval positive = abs(a);
+	return Interval(positive.lo * positive.lo, positive.hi * positive.hi);
+}
+// Square roots of negative numbers are NaN, which is never inside or outside, so there are no bounds if the range goes below 0
+inline Interval sqrt(Interval a){
+	if (a.lo < 0) return Interval(-INFINITY, INFINITY);
+	return Interval(std::sqrt(a.lo), std::sqrt(a.hi));
+}
+
+// The sine is 1 at pi/2 + 2k pi and -1 at -pi/2 + 2k pi; anywhere else the extremes are at the ends of the range
+inline Interval sin(Interval a){
+	const double PI = 3.14159265358979;
+	if (a.hi - a.lo >= 2 * PI) return Interval(-1, 1);
+	double ends[2] = {std::sin((double)a.lo), std::sin((double)a.hi)};
+	Interval result(std::min(ends[0], ends[1]), std::max(ends[0], ends[1]));
+	if (std::ceil((a.lo - PI / 2) / (2 * PI)) * 2 * PI + PI / 2 <= a.hi) result.hi = 1;
+	if (std::ceil((a.lo + PI / 2) / (2 * PI)) * 2 * PI - PI / 2 <= a.hi) result.lo = -1;
+	return result;
+}
+
+inline Interval cos(Interval a){
+	return sin(a + 1.57079632679490f);
+}
+
+// Built-in generation functions. These work on single floats and on FloatBatches, so whole rows of points
+// can be evaluated with SIMD instructions, and on Intervals for empty-space skipping. Pick one with --function.
+// Their gradient() is exact, and is used for the vertex normals with --gradient-normals.
+struct SphereFunction{
+	template <typename T>
+	T operator()(T x, T y, T z) const{
+		return x * x + y * y + z * z;
+	}
+
+	glm::vec3 gradient(float x, float y, float z) const{
+		return glm::vec3(2 * x, 2 * y, 2 * z);
+	}
+};
+
+struct WaveFunction{
+	template <typename T>
+	T operator()(T x, T y, T z) const{
+		return y - (sin(x) * cos(z));
+	}
+
+	glm::vec3 gradient(float x, float /*y*/, float z) const{
+		return glm::vec3(-std::cos(x) * std::cos(z), 1, std::sin(x) * std::sin(z));
+	}
+};
+
+struct TubeFunction{
+	template <typename T>
+	T operator()(T x, T y, T z) const{
+		return x * x - y * y - z * z - z;
+	}
+
+	glm::vec3 gradient(float x, float y, float z) const{
+		return glm::vec3(2 * x, -2 * y, -2 * z - 1);
+	}
+};
+
+// Value and gradient carried through each operation together (forward-mode automatic differentiation), so running
+// an ExpressionFunction's bytecode on Duals gives its exact gradient
+struct Dual{
+	float v;
+	glm::vec3 d;
+
+	Dual(){}
+	Dual(float value) : v(value), d(0.0f) {}
+	Dual(float value, glm::vec3 derivative) : v(value), d(derivative) {}
+};
+inline Dual operator+(Dual a, Dual b){ return Dual(a.v + b.v, a.d + b.d); }
+inline Dual operator-(Dual a, Dual b){ return Dual(a.v - b.v, a.d - b.d); }
+inline Dual operator*(Dual a, Dual b){ return Dual(a.v * b.v, a.d * b.v + b.d * a.v); }
+inline Dual operator/(Dual a, Dual b){ return Dual(a.v / b.v, (a.d * b.v - b.d * a.v) * (1 / (b.v * b.v))); }
+inline Dual sin(Dual a){ return Dual(std::sin(a.v), a.d * std::cos(a.v)); }
+inline Dual cos(Dual a){ return Dual(std::cos(a.v), a.d * -std::sin(a.v)); }
+inline Dual sqrt(Dual a){ float root = std::sqrt(a.v); return Dual(root, a.d * (0.5f / root)); }
+inline Dual abs(Dual a){ return a.v < 0 ? Dual(-a.v, -a.d) : a; }
+inline Dual min(Dual a, Dual b){ return a.v <= b.v ? a : b; }
+inline Dual max(Dual a, Dual b){ return a.v >= b.v ? a : b; }
+
+template <typename T>
+inline T square(T a){
+	return a * a;
+}
+
+// Generation function given as a math expression on the command line (--expression), e.g. "y - sin(x) * cos(z)".
+// The expression is parsed once and compiled into bytecode for a small register machine: registers 0 to 2 hold x, y
+// and z, and the rest hold constants and temporaries, which are reused as soon as their value has been read.
+// evaluateRow() runs each instruction over a whole row of points (ROW_CHUNK at a time) with FloatBatches before
+// moving on to the next one, so decoding an instruction costs the same for a whole row as for one point. The same
+// bytecode also runs on single floats, on Intervals (for empty-space skipping) and on Duals (for gradient()).
+class ExpressionFunction{
+public:
+	enum Op : uint8_t{
+		Add, Subtract, Multiply, Divide, Negate, Square, Sin, Cos, Sqrt, Abs, Min, Max
+	};
+	// Unary operations ignore b
+	struct Instruction{
+		Op op;
+		uint8_t result, a, b;
+	};
+	static const int INPUTS = 3;			// x, y, z
+	static const int MAX_REGISTERS = 64;
+	static constexpr int ROW_CHUNK = 256;		// Points per register in evaluateRow (a multiple of FloatBatch::WIDTH)
+
+private:
+	struct Constant{
+		int reg;
+		float value;
+	};
+
+	friend class ExpressionCompiler;
+	std::vector<Instruction> code;
+	std::vector<Constant> constants;
+	int registerCount = INPUTS;
+	int output = 0;							// Register holding the result
+
+	// using std:: lets plain floats use the standard functions, while the other types find their own
+	template <typename T>
+	static T apply(Op op, T a, T b){
+		using std::sin; using std::cos; using std::sqrt; using std::abs; using std::min; using std::max;
+		switch (op){
+			case Add: return a + b;
+			case Subtract: return a - b;
+			case Multiply: return a * b;
+			case Divide: return a / b;
+			case Negate: return T(0.0f) - a;
+			case Square: return square(a);
+			case Sin: return sin(a);
+			case Cos: return cos(a);
+			case Sqrt: return sqrt(a);
+			case Abs: return abs(a);
+			case Min: return min(a, b);
+			case Max: return max(a, b);
+		}
+		return a;
+	}
+
+	// One instruction over a row of count points (a multiple of FloatBatch::WIDTH). op is a template parameter so the
+	// switch in apply() is resolved at compile time and the loop is just the operation.
+	template <Op op>
+	static void applyRow(const float* a, const float* b, float* result, int count){
+		for (int i = 0; i < count; i += FloatBatch::WIDTH){
+			apply(op, FloatBatch::load(a + i), FloatBatch::load(b + i)).store(result + i);
+		}
+	}
+
+public:
+	// Parses and compiles the expression. Returns false with a description of the problem in error if it isn't valid.
+	bool compile(const std::string& text, std::string& error);
+
+	int getInstructionCount() const{
+		return code.size();
+	}
+
+	int getRegisterCount() const{
+		return registerCount;
+	}
+
+	template <typename T>
+	T operator()(T x, T y, T z) const{
+		T registers[MAX_REGISTERS];
+		registers[0] = x;
+		registers[1] = y;
+		registers[2] = z;
+		for (const Constant& constant : constants){
+			registers[constant.reg] = T(constant.value);
+		}
+		for (const Instruction& instruction : code){
+			registers[instruction.result] = apply(instruction.op, registers[instruction.a], registers[instruction.b]);
+		}
+		return registers[output];
+	}
+
+	glm::vec3 gradient(float x, float y, float z) const{
+		return (*this)(Dual(x, glm::vec3(1, 0, 0)), Dual(y, glm::vec3(0, 1, 0)), Dual(z, glm::vec3(0, 0, 1))).d;
+	}
+
+	// Evaluates the expression at count points given by the coordinate lists. Every point goes through the batch
+	// versions of the operations (the end of a row is padded with copies of the last point), so a point gets the same
+	// value no matter where its row starts.
+	void evaluateRow(const float* xs, const float* ys, const float* zs, float* out, int count) const{
+		// Registers for the temporaries and constants, and for inputs that need padding. One set per thread.
+		thread_local std::vector<float> storage;
+		storage.resize((size_t)registerCount * ROW_CHUNK);
+		const float* registers[MAX_REGISTERS];
+		for (int r = INPUTS; r < registerCount; r++){
+			registers[r] = &storage[r * ROW_CHUNK];
+		}
+		for (const Constant& constant : constants){
+			std::fill(&storage[constant.reg * ROW_CHUNK], &storage[(constant.reg + 1) * ROW_CHUNK], constant.value);
+		}
+		const float* inputs[INPUTS] = {xs, ys, zs};
+
+		for (int start = 0; start < count; start += ROW_CHUNK){
+			int n = std::min(ROW_CHUNK, count - start);
+			int padded = (n + FloatBatch::WIDTH - 1) / FloatBatch::WIDTH * FloatBatch::WIDTH;
+			for (int d = 0; d < INPUTS; d++){
+				if (padded == n){
+					registers[d] = inputs[d] + start;
+				}
+				else{
+					float* input = &storage[d * ROW_CHUNK];
+					std::copy(inputs[d] + start, inputs[d] + start + n, input);
+					std::fill(input + n, input + padded, inputs[d][start + n - 1]);
+					registers[d] = input;
+				}
+			}
+			for (const Instruction& instruction : code){
+				const float* a = registers[instruction.a];
+				const float* b = registers[instruction.b];
+				float* result = &storage[instruction.result * ROW_CHUNK];
+				switch (instruction.op){
+					case Add: applyRow<Add>(a, b, result, padded); break;
+					case Subtract: applyRow<Subtract>(a, b, result, padded); break;
+					case Multiply: applyRow<Multiply>(a, b, result, padded); break;
+					case Divide: applyRow<Divide>(a, b, result, padded); break;
+					case Negate: applyRow<Negate>(a, b, result, padded); break;
+					case Square: applyRow<Square>(a, b, result, padded); break;
+					case Sin: applyRow<Sin>(a, b, result, padded); break;
+					case Cos: applyRow<Cos>(a, b, result, padded); break;
+					case Sqrt: applyRow<Sqrt>(a, b, result, padded); break;
+					case Abs: applyRow<Abs>(a, b, result, padded); break;
+					case Min: applyRow<Min>(a, b, result, padded); break;
+					case Max: applyRow<Max>(a, b, result, padded); break;
+				}
+			}
+			std::copy(registers[output], registers[output] + n, out + start);
+		}
+	}
+};
+
+// Recursive descent parser for ExpressionFunction, which writes the bytecode as it goes. Grammar:
+//   expression = term {("+" | "-") term}
+//   term       = factor {("*" | "/") factor}
+//   factor     = ("-" | "+") factor | power
+//   power      = primary ["^" factor]				(the exponent has to work out to a whole number)
+//   primary    = number | x | y | z | pi | "(" expression ")" | function "(" expression ["," expression] ")"
+// Functions are sin, cos, sqrt, abs, min and max. Operations on constants are worked out while compiling.
+class ExpressionCompiler{
+	// A value while compiling: either a constant, or the register holding it
+	struct Operand{
+		bool constant;
+		float value;
+		int reg;
+	};
+
+	ExpressionFunction& function;
+	const std::string& text;
+	size_t position = 0;
+	std::string error;
+	bool temporary[ExpressionFunction::MAX_REGISTERS] = {};	// Registers holding temporaries
+	std::vector<int> freeTemporaries;
+
+	bool fail(const std::string& message){
+		if (error.empty()) error = message + " at character " + std::to_string(position + 1);
+		return false;
+	}
+
+	void skipSpaces(){
+		while (position < text.size() && isspace((unsigned char)text[position])) position++;
+	}
+
+	// Skips over c (and any spaces before it) if it's next
+	bool accept(char c){
+		skipSpaces();
+		if (position < text.size() && text[position] == c){
+			position++;
+			return true;
+		}
+		return false;
+	}
+
+	bool expect(char c){
+		return accept(c) || fail(std::string("Expected '") + c + "'");
+	}
+
+	// Adds a register, or returns -1 if there are too many
+	int newRegister(){
+		if (function.registerCount >= ExpressionFunction::MAX_REGISTERS){
+			fail("Expression is too complicated");
+			return -1;
+		}
+		return function.registerCount++;
+	}
+
+	// Register holding an operand, adding a register for a new constant
+	int operandRegister(const Operand& operand){
+		if (!operand.constant) return operand.reg;
+		for (const ExpressionFunction::Constant& constant : function.constants){
+			if (constant.value == operand.value) return constant.reg;
+		}
+		int reg = newRegister();
+		if (reg >= 0) function.constants.push_back({reg, operand.value});
+		return reg;
+	}
+
+	// Lets a temporary be reused once its value has been read
+	void release(const Operand& operand){
+		if (!operand.constant && temporary[operand.reg]){
+			temporary[operand.reg] = false;
+			freeTemporaries.push_back(operand.reg);
+		}
+	}
+
+	// Adds an instruction (or works it out now if its operands are constants) and returns its result
+	Operand emit(ExpressionFunction::Op op, Operand a, Operand b){
+		if (a.constant && b.constant){
+			return {true, ExpressionFunction::apply(op, a.value, b.value), 0};
+		}
+		if (op == ExpressionFunction::Multiply && !a.constant && !b.constant && a.reg == b.reg){
+			op = ExpressionFunction::Square;
+		}
+		int aReg = operandRegister(a);
+		int bReg = operandRegister(b);
+		// The result can go in an operand's register, since each point is read before it's written
+		release(a);
+		release(b);
+		int result;
+		if (!freeTemporaries.empty()){
+			auto lowest = std::min_element(freeTemporaries.begin(), freeTemporaries.end());
+			result = *lowest;
+			freeTemporaries.erase(lowest);
+		}
+		else{
+			result = newRegister();
+		}
+		if (aReg < 0 || bReg < 0 || result < 0) return a;
+		temporary[result] = true;
+		function.code.push_back({op, (uint8_t)result, (uint8_t)aReg, (uint8_t)bReg});
+		return {false, 0, result};
+	}
+
+	Operand unary(ExpressionFunction::Op op, Operand a){
+		return emit(op, a, a);
+	}
+
+	bool parseExpression(Operand& result){
+		if (!parseTerm(result)) return false;
+		while (true){
+			ExpressionFunction::Op op;
+			if (accept('+')) op = ExpressionFunction::Add;
+			else if (accept('-')) op = ExpressionFunction::Subtract;
+			else return true;
+			Operand right;
+			if (!parseTerm(right)) return false;
+			result = emit(op, result, right);
+		}
+	}
+
+	bool parseTerm(Operand& result){
+		if (!parseFactor(result)) return false;
+		while (true){
+			ExpressionFunction::Op op;
+			if (accept('*')) op = ExpressionFunction::Multiply;
+			else if (accept('/')) op = ExpressionFunction::Divide;
+			else return true;
+			Operand right;
+			if (!parseFactor(right)) return false;
+			result = emit(op, result, right);
+		}
+	}
+
+	bool parseFactor(Operand& result){
+		if (accept('-')){
+			if (!parseFactor(result)) return false;
+			result = unary(ExpressionFunction::Negate, result);
+			return true;
+		}
+		if (accept('+')) return parseFactor(result);
+		return parsePower(result);
+	}
+
+	// Whole number powers are worked out by squaring and multiplying, from the highest bit of the exponent down
+	bool parsePower(Operand& result){
+		if (!parsePrimary(result)) return false;
+		if (!accept('^')) return true;
+		size_t start = position;
+		Operand exponent;
+		if (!parseFactor(exponent)) return false;
+		if (!exponent.constant || exponent.value != std::floor(exponent.value) || std::abs(exponent.value) > 64){
+			position = start;
+			return fail("Exponent must be a whole number from -64 to 64");
+		}
+		int n = std::abs((int)exponent.value);
+		Operand base = result;
+		if (n == 0){
+			release(base);
+			result = {true, 1, 0};
+			return true;
+		}
+		// The base is read by every multiply, so it can't be released until the end
+		bool baseTemporary = !base.constant && temporary[base.reg];
+		if (baseTemporary) temporary[base.reg] = false;
+		int bit = 31 - __builtin_clz(n);
+		for (bit--; bit >= 0; bit--){
+			result = unary(ExpressionFunction::Square, result);
+			if (n & (1 << bit)) result = emit(ExpressionFunction::Multiply, result, base);
+		}
+		if (baseTemporary){
+			temporary[base.reg] = true;
+			if (n > 1) release(base);
+		}
+		if (exponent.value < 0) result = emit(ExpressionFunction::Divide, {true, 1, 0}, result);
+		return error.empty();
+	}
+
+	bool parsePrimary(Operand& result){
+		skipSpaces();
+		if (position >= text.size()) return fail("Unexpected end of expression");
+		char c = text[position];
+		if (accept('(')){
+			return parseExpression(result) && expect(')');
+		}
+		if (isdigit((unsigned char)c) || c == '.'){
+			const char* begin = text.c_str() + position;
+			char* end;
+			float value = strtof(begin, &end);
+			if (end == begin) return fail("Bad number");
+			position += end - begin;
+			result = {true, value, 0};
+			return true;
+		}
+		if (!isalpha((unsigned char)c)) return fail(std::string("Unexpected '") + c + "'");
+		size_t start = position;
+		while (position < text.size() && isalnum((unsigned char)text[position])) position++;
+		std::string name = text.substr(start, position - start);
+		if (name == "x" || name == "y" || name == "z"){
+			result = {false, 0, name[0] - 'x'};
+			return true;
+		}
+		if (name == "pi"){
+			result = {true, 3.14159265358979f, 0};
+			return true;
+		}
+
+		const struct{
+			const char* name;
+			ExpressionFunction::Op op;
+			int arguments;
+		} functions[] = {
+			{"sin", ExpressionFunction::Sin, 1}, {"cos", ExpressionFunction::Cos, 1},
+			{"sqrt", ExpressionFunction::Sqrt, 1}, {"abs", ExpressionFunction::Abs, 1},
+			{"min", ExpressionFunction::Min, 2}, {"max", ExpressionFunction::Max, 2}
+		};
+		for (const auto& f : functions){
+			if (name != f.name) continue;
+			if (!expect('(') || !parseExpression(result)) return false;
+			if (f.arguments == 2){
+				Operand second;
+				if (!expect(',') || !parseExpression(second)) return false;
+				result = emit(f.op, result, second);
+			}
+			else{
+				result = unary(f.op, result);
+			}
+			return expect(')');
+		}
+		position = start;
+		return fail("Unknown name '" + name + "'");
+	}
+
+public:
+	ExpressionCompiler(ExpressionFunction& f, const std::string& t) : function(f), text(t) {}
+
+	bool compile(std::string& message){
+		function.code.clear();
+		function.constants.clear();
+		function.registerCount = ExpressionFunction::INPUTS;
+		Operand result;
+		if (parseExpression(result)){
+			skipSpaces();
+			if (position < text.size()) fail(std::string("Unexpected '") + text[position] + "'");
+		}
+		if (error.empty()) function.output = operandRegister(result);
+		message = error;
+		return error.empty();
+	}
+};
+
+bool ExpressionFunction::compile(const std::string& text, std::string& error){
+	return ExpressionCompiler(*this, text).compile(error);
+}
+
+// Read-only memory map of a whole file. Pages are only read from the disk when they're first touched,
+// so a file of any size opens straight away. Only on Linux and other Unix-like systems.
+class MappedFile{
+	const unsigned char* bytes = nullptr;
+	size_t length = 0;
+
+public:
+	MappedFile(){}
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	~MappedFile(){
+		close();
+	}
+
+	bool open(const std::string& filename){
+		close();
+#if defined(__unix__) || defined(__APPLE__)
+		int file = ::open(filename.c_str(), O_RDONLY);
+		if (file < 0) return false;
+		struct stat info;
+		if (fstat(file, &info) != 0 || info.st_size == 0){
+			::close(file);
+			return false;
+		}
+		void* mapped = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+		::close(file);	// The mapping keeps the file open
+		if (mapped == MAP_FAILED) return false;
+		bytes = (const unsigned char*)mapped;
+		length = info.st_size;
+		return true;
+#else
+		return false;
+#endif
+	}
+
+	void close(){
+#if defined(__unix__) || defined(__APPLE__)
+		if (bytes != nullptr) munmap((void*)bytes, length);
+#endif
+		bytes = nullptr;
+		length = 0;
+	}
+
+	const unsigned char* data() const{
+		return bytes;
+	}
+
+	size_t size() const{
+		return length;
+	}
+};
+
+enum VoxelType{
+	VoxelFloat,		// 32-bit floats
+	VoxelUint16		// 16-bit unsigned integers
+};
+
+// Size and layout of a voxel volume file: size[0] * size[1] * size[2] little-endian voxels, X fastest, then Y, then Z,
+// starting offset bytes into the file
+struct VolumeInfo{
+	int size[3] = {0, 0, 0};
+	VoxelType type = VoxelFloat;
+	size_t offset = 0;
+};
+
+// Reads the optional header line at the start of a volume file: "as5volume NX NY NZ float|uint16", ending with a newline.
+// The voxels start straight after it. Returns false if the file doesn't start with a header.
+bool readVolumeHeader(const MappedFile& file, VolumeInfo& info){
+	const char MAGIC[] = "as5volume ";
+	size_t magicLength = sizeof(MAGIC) - 1;
+	if (file.size() < magicLength || memcmp(file.data(), MAGIC, magicLength) != 0) return false;
+	const unsigned char* end = (const unsigned char*)memchr(file.data(), '\n', std::min(file.size(), (size_t)256));
+	if (end == nullptr) return false;
+	std::string line((const char*)file.data(), end - file.data());
+	char type[16];
+	if (sscanf(line.c_str() + magicLength, "%d %d %d %15s", &info.size[0], &info.size[1], &info.size[2], type) != 4) return false;
+	if (strcmp(type, "float") == 0) info.type = VoxelFloat;
+	else if (strcmp(type, "uint16") == 0) info.type = VoxelUint16;
+	else return false;
+	info.offset = end - file.data() + 1;
+	return true;
+}
+
+// Generation function that reads a voxel volume (CT scans, simulation dumps...) straight from a memory-mapped file.
+// The volume is fitted into the [min, max] box along its longest side and centred along the others, so voxels are
+// (max - min) / (longest side - 1) apart. Between voxels the value is trilinearly interpolated, and points outside
+// the volume get the value at its nearest edge. Nothing is read until a point is sampled, so generation starts
+// straight away however big the file is, and only the pages around the surface being generated have to be in memory.
+template <typename Voxel>
+class VolumeFunction{
+	const unsigned char* voxels = nullptr;
+	int size[3] = {1, 1, 1};
+	float origin[3] = {0, 0, 0};	// Position of voxel (0, 0, 0)
+	float scale = 1;				// Voxels per unit
+
+	// Voxels aren't necessarily aligned after the header, so they're put together a byte at a time, in little-endian
+	// order no matter what the host uses (compilers turn this into a single load on little-endian hosts)
+	float voxel(int i, int j, int k) const{
+		const unsigned char* bytes = voxels + (((size_t)k * size[1] + j) * size[0] + i) * sizeof(Voxel);
+		typename std::conditional<sizeof(Voxel) == 4, uint32_t, uint16_t>::type bits = 0;
+		for (size_t b = 0; b < sizeof(Voxel); b++){
+			bits |= (decltype(bits))bytes[b] << (8 * b);
+		}
+		Voxel value;
+		memcpy(&value, &bits, sizeof(Voxel));
+		return (float)value;
+	}
+
+public:
+	VolumeFunction(){}
+	VolumeFunction(const unsigned char* data, const int dimensions[3], float min, float max) : voxels(data){
+		int longest = std::max(std::max(dimensions[0], dimensions[1]), dimensions[2]);
+		float spacing = (max - min) / std::max(longest - 1, 1);
+		scale = 1 / spacing;
+		for (int d = 0; d < 3; d++){
+			size[d] = dimensions[d];
+			origin[d] = min + (longest - size[d]) * spacing / 2;
+		}
+	}
+
+	float operator()(float x, float y, float z) const{
+		float p[3] = {x, y, z};
+		int i0[3], i1[3];
+		float t[3];
+		for (int d = 0; d < 3; d++){
+			float c = std::min(std::max((p[d] - origin[d]) * scale, 0.0f), (float)(size[d] - 1));
+			i0[d] = std::min((int)c, std::max(size[d] - 2, 0));
+			i1[d] = std::min(i0[d] + 1, size[d] - 1);
+			t[d] = c - i0[d];
+		}
+		auto lerp = [](float a, float b, float t){ return a + (b - a) * t; };
+		float bottom = lerp(lerp(voxel(i0[0], i0[1], i0[2]), voxel(i1[0], i0[1], i0[2]), t[0]),
+			lerp(voxel(i0[0], i1[1], i0[2]), voxel(i1[0], i1[1], i0[2]), t[0]), t[1]);
+		float top = lerp(lerp(voxel(i0[0], i0[1], i1[2]), voxel(i1[0], i0[1], i1[2]), t[0]),
+			lerp(voxel(i0[0], i1[1], i1[2]), voxel(i1[0], i1[1], i1[2]), t[0]), t[1]);
+		return lerp(bottom, top, t[2]);
+	}
+};
+
+// True for functions that can be called with FloatBatches
+template <typename F, typename = void>
+struct IsBatchFunction : std::false_type {};
+template <typename F>
+struct IsBatchFunction<F, typename std::enable_if<std::is_same<decltype(std::declval<const F&>()(FloatBatch(), FloatBatch(), FloatBatch())), FloatBatch>::value>::type> : std::true_type {};
+
+// True for functions that can be called with Intervals
+template <typename F, typename = void>
+struct IsIntervalFunction : std::false_type {};
+template <typename F>
+struct IsIntervalFunction<F, typename std::enable_if<std::is_same<decltype(std::declval<const F&>()(Interval(0), Interval(0), Interval(0))), Interval>::value>::type> : std::true_type {};
+
+// True for functions with a gradient(x, y, z) member that returns their gradient
+template <typename F, typename = void>
+struct HasGradient : std::false_type {};
+template <typename F>
+struct HasGradient<F, typename std::enable_if<std::is_same<decltype(std::declval<const F&>().gradient(0.0f, 0.0f, 0.0f)), glm::vec3>::value>::type> : std::true_type {};
+
+// True for functions with their own evaluateRow(xs, ys, zs, out, count), which sampling uses instead of calling them
+template <typename F, typename = void>
+struct IsRowFunction : std::false_type {};
+template <typename F>
+struct IsRowFunction<F, typename std::enable_if<std::is_void<decltype(std::declval<const F&>().evaluateRow((const float*)0, (const float*)0, (const float*)0, (float*)0, 0))>::value>::type> : std::true_type {};
+
 // Default parameters
 const float DEFAULT_ISO = 1.0f;
 const float DEFAULT_MIN = -2.0f;
 const float DEFAULT_MAX = 2.0f;
 const float DEFAULT_STEP = 0.01f;
 const float ZOOM_SPEED = 4.0f;
+const float ISO_STEPS = 200.0f;		// Mouse wheel notches across the whole range of sampled values (--retain)
+const float ISO_KEY_SPEED = 20.0f;	// Notches per second while + or - is held (--retain)
 const GLfloat MODEL_COLOR[4] = {0.0f, 0.8f, 0.3f, 1.0f};
 const GLfloat LIGHT_DIRECTION[3] = {1.0f, 1.5f, 1.0f};
 
 GLFWwindow* window;
+double scrollOffset = 0;	// Mouse wheel notches since the last frame
+
+void scrollCallback(GLFWwindow*, double, double yOffset){
+	scrollOffset += yOffset;
+}
 
 // Changes the operation of the marching cubes function.
 // Full: Generates the whole mesh in one go (slow)
 // Incremental: Generates a single "slice" along one axis each time generate() is called
+// Adaptive: Generates the whole mesh in one go on an octree that is only refined near the surface where it curves
+// Chunked: Generates one brick of cubes per thread each time generate() is called, and only keeps the new part of the mesh
 enum CubesMode{
 	Full,
 	Incremental_X,
 	Incremental_Y,
-	Incremental_Z
+	Incremental_Z,
+	Adaptive,
+	Chunked
 };
 
 // Different comparisons to use when testing if a point is inside.
@@ -62,154 +951,1672 @@ enum CompareOperation{
 	GreaterEqual
 };
 
-// Handles marching cubes mesh generation
-class MarchingCubes{
-		CubesMode generationMode = Full;
-		CompareOperation comparator = Less;
-		std::function<float(float, float, float)> generationFunction;
-		float isoValue = 0;
-		float minCoord = 0;
-		float maxCoord = 1;
-		float stepSize = 0.1;
-		float currentIteration = 0;
-		std::vector<float> vertices;
+// Comparison parameter of MarchingCubes that picks the comparison at run time (from the constructor) instead of compile time
+const int RUNTIME_COMPARE = -1;
 
-		// Generates the entire mesh (non-incremental)
-		void generateFull(){
-			float bbl, bbr, bfr, bfl, tbl, tbr, tfr, tfl;
-			int index;
-			int* verts;
-
-			for (float x = minCoord; x < maxCoord; x += stepSize){
-				for (float y = minCoord; y < maxCoord; y += stepSize){
-					for (float z = minCoord; z < maxCoord; z += stepSize){
-						// Test the 8 points
-						bbl = generationFunction(x, y, z);
-						bbr = generationFunction(x + stepSize, y, z);
-						bfr = generationFunction(x + stepSize, y, z + stepSize);
-						bfl = generationFunction(x, y, z + stepSize);
-						tbl = generationFunction(x, y + stepSize, z);
-						tbr = generationFunction(x + stepSize, y + stepSize, z);
-						tfr = generationFunction(x + stepSize, y + stepSize, z + stepSize);
-						tfl = generationFunction(x, y + stepSize, z + stepSize);
-
-						index = 0;
-						if (test(bbl)) index |= BOTTOM_BACK_LEFT;
-						if (test(bbr)) index |= BOTTOM_BACK_RIGHT;
-						if (test(bfr)) index |= BOTTOM_FRONT_RIGHT;
-						if (test(bfl)) index |= BOTTOM_FRONT_LEFT;
-						if (test(tbl)) index |= TOP_BACK_LEFT;
-						if (test(tbr)) index |= TOP_BACK_RIGHT;
-						if (test(tfr)) index |= TOP_FRONT_RIGHT;
-						if (test(tfl)) index |= TOP_FRONT_LEFT;
-
-						verts = marching_cubes_lut[index];
-						add_triangles(verts, x, y, z);
-					}
-				}
+// Integer-indexed grid of points covering [min, max] along one axis.
+// Coordinates are computed from the index instead of by repeatedly adding the step,
+// so the number of cells is exact and no cells get dropped or duplicated by rounding error.
+struct Grid{
+	float min = 0;
+	float step = 1;
+	int cells = 0;	// Number of cubes along the axis; there is one more point than cells
+
+	Grid(){}
+	Grid(float minCoord, float maxCoord, float stepSize) : min(minCoord), step(stepSize){
+		// Same cells as "for (x = min; x < max; x += step)" would visit with exact arithmetic.
+		// A range that is a whole number of steps (up to float precision) doesn't get an extra cell.
+		double span = ((double)maxCoord - minCoord) / stepSize;
+		double rounded = std::round(span);
+		cells = std::max(1, (int)(std::abs(span - rounded) < 1e-4 * std::max(1.0, rounded) ? rounded : std::ceil(span)));
+	}
+
+	int points() const{
+		return cells + 1;
+	}
+
+	float coord(int i) const{
+		return min + i * step;
+	}
+
+	// Total number of cubes in a cubic volume of this grid
+	long long cubeCount() const{
+		return (long long)cells * cells * cells;
+	}
+};
+
+// Read-only view of part of an array, so mesh data can be read without copying it.
+// Only valid until the array it points into changes (i.e. the next call to generate()).
+template <typename T>
+struct ArrayView{
+	const T* data = nullptr;
+	size_t size = 0;
+
+	ArrayView(){}
+	ArrayView(const T* d, size_t s) : data(d), size(s) {}
+	ArrayView(const std::vector<T>& v, size_t first = 0) : data(v.data() + std::min(first, v.size())), size(v.size() - std::min(first, v.size())) {}
+
+	const T* begin() const{ return data; }
+	const T* end() const{ return data + size; }
+	const T& operator[](size_t i) const{ return data[i]; }
+	bool empty() const{ return size == 0; }
+};
+
+// The part of the mesh added since an earlier revision
+struct MeshDelta{
+	ArrayView<float> vertices;			// New vertices (3 floats each)
+	ArrayView<unsigned int> indices;	// New indices (indexed mode)
+	size_t firstVertex = 0;				// Position of the first new float in the whole vertices list
+	size_t firstIndex = 0;				// Position of the first new index in the whole index list
+	size_t changedNormals = 0;			// Position of the first float whose normal changed (new triangles can use old vertices in indexed mode)
+	size_t finalNormals = 0;			// Number of floats whose normals can't change any more
+};
+
+// Mesh produced by marching cubes.
+// Without indexing, every 3 vertices form a triangle and indices/normalSums are empty.
+// With indexing, vertices on shared cube edges are welded: indices lists 3 vertex numbers per triangle,
+// and normalSums holds the sum of the (area weighted) face normals around each vertex.
+// With gradient normals, normalSums holds a normal worked out from the function's gradient for every vertex, indexed or not.
+struct MeshData{
+	std::vector<float> vertices;
+	std::vector<unsigned int> indices;
+	std::vector<float> normalSums;
+	std::vector<uint64_t> edgeKeys;	// Cube edge each vertex is on (indexed Chunked mode, see MarchingCubes::edgeKey)
+};
+
+// Array made of fixed-size pages. Growing it never moves what's already in it, unlike a std::vector, which copies
+// everything into an allocation twice the size (and briefly holds both); at most one page is partly unused.
+// Only for plain number types, since the pages are raw memory.
+template <typename T>
+class PagedArray{
+	static constexpr size_t PAGE_SIZE = 1 << 16;	// Elements per page
+	std::vector<T*> pages;
+	size_t count = 0;
+
+	// Pages come straight from the operating system where possible, so each one is handed back as soon as it's freed.
+	// (malloc keeps freed blocks below its mmap threshold, which rises to the biggest block freed so far.)
+	static T* allocatePage(){
+#if defined(__unix__) || defined(__APPLE__)
+		void* page = mmap(nullptr, PAGE_SIZE * sizeof(T), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (page == MAP_FAILED) throw std::bad_alloc();
+		return (T*)page;
+#else
+		return new T[PAGE_SIZE];
+#endif
+	}
+	static void freePage(T* page){
+#if defined(__unix__) || defined(__APPLE__)
+		munmap(page, PAGE_SIZE * sizeof(T));
+#else
+		delete[] page;
+#endif
+	}
+
+public:
+	PagedArray(){}
+	PagedArray(const PagedArray&) = delete;
+	PagedArray& operator=(PagedArray other){
+		std::swap(pages, other.pages);
+		std::swap(count, other.count);
+		return *this;
+	}
+	PagedArray(PagedArray&& other){
+		std::swap(pages, other.pages);
+		std::swap(count, other.count);
+	}
+	~PagedArray(){
+		for (T* page : pages){
+			freePage(page);
+		}
+	}
+
+	T& operator[](size_t i){
+		return pages[i / PAGE_SIZE][i % PAGE_SIZE];
+	}
+	const T& operator[](size_t i) const{
+		return pages[i / PAGE_SIZE][i % PAGE_SIZE];
+	}
+
+	size_t size() const{
+		return count;
+	}
+
+	// Adds n values to the end
+	void append(const T* values, size_t n){
+		while (n > 0){
+			size_t offset = count % PAGE_SIZE;
+			if (offset == 0 && count / PAGE_SIZE == pages.size()){
+				pages.emplace_back(allocatePage());
 			}
-			finished = true;
+			size_t part = std::min(n, PAGE_SIZE - offset);
+			std::copy(values, values + part, pages[count / PAGE_SIZE] + offset);
+			values += part;
+			count += part;
+			n -= part;
 		}
+	}
 
-		// Generates one slice of the mesh
-		void generateIterative(){
-			float bbl, bbr, bfr, bfl, tbl, tbr, tfr, tfl;
-			int index;
-			int* verts;
-			
-			for (float a = minCoord; a < maxCoord; a += stepSize){
-				for (float b = minCoord; b < maxCoord; b += stepSize){
-					switch (generationMode){
-						case Incremental_X:
-							// A is Y, B is Z
-							// Test the 8 points
-							bbl = generationFunction(currentIteration, a, b);
-							bbr = generationFunction(currentIteration + stepSize, a, b);
-							bfr = generationFunction(currentIteration + stepSize, a, b + stepSize);
-							bfl = generationFunction(currentIteration, a, b + stepSize);
-							tbl = generationFunction(currentIteration, a + stepSize, b);
-							tbr = generationFunction(currentIteration + stepSize, a + stepSize, b);
-							tfr = generationFunction(currentIteration + stepSize, a + stepSize, b + stepSize);
-							tfl = generationFunction(currentIteration, a + stepSize, b + stepSize);
-
-							index = 0;
-							if (test(bbl)) index |= BOTTOM_BACK_LEFT;
-							if (test(bbr)) index |= BOTTOM_BACK_RIGHT;
-							if (test(bfr)) index |= BOTTOM_FRONT_RIGHT;
-							if (test(bfl)) index |= BOTTOM_FRONT_LEFT;
-							if (test(tbl)) index |= TOP_BACK_LEFT;
-							if (test(tbr)) index |= TOP_BACK_RIGHT;
-							if (test(tfr)) index |= TOP_FRONT_RIGHT;
-							if (test(tfl)) index |= TOP_FRONT_LEFT;
-
-							verts = marching_cubes_lut[index];
-							add_triangles(verts, currentIteration, a, b);
-							break;
-						case Incremental_Y:
-							// A is X, B is Z
-							// Test the 8 points
-							bbl = generationFunction(a, currentIteration, b);
-							bbr = generationFunction(a + stepSize, currentIteration, b);
-							bfr = generationFunction(a + stepSize, currentIteration, b + stepSize);
-							bfl = generationFunction(a, currentIteration, b + stepSize);
-							tbl = generationFunction(a, currentIteration + stepSize, b);
-							tbr = generationFunction(a + stepSize, currentIteration + stepSize, b);
-							tfr = generationFunction(a + stepSize, currentIteration + stepSize, b + stepSize);
-							tfl = generationFunction(a, currentIteration + stepSize, b + stepSize);
-
-							index = 0;
-							if (test(bbl)) index |= BOTTOM_BACK_LEFT;
-							if (test(bbr)) index |= BOTTOM_BACK_RIGHT;
-							if (test(bfr)) index |= BOTTOM_FRONT_RIGHT;
-							if (test(bfl)) index |= BOTTOM_FRONT_LEFT;
-							if (test(tbl)) index |= TOP_BACK_LEFT;
-							if (test(tbr)) index |= TOP_BACK_RIGHT;
-							if (test(tfr)) index |= TOP_FRONT_RIGHT;
-							if (test(tfl)) index |= TOP_FRONT_LEFT;
-
-							verts = marching_cubes_lut[index];
-							add_triangles(verts, a, currentIteration, b);
-							break;
-						case Incremental_Z:
-							// A is X, B is Y
-							// Test the 8 points
-							bbl = generationFunction(a, b, currentIteration);
-							bbr = generationFunction(a + stepSize, b, currentIteration);
-							bfr = generationFunction(a + stepSize, b, currentIteration + stepSize);
-							bfl = generationFunction(a, b, currentIteration + stepSize);
-							tbl = generationFunction(a, b + stepSize, currentIteration);
-							tbr = generationFunction(a + stepSize, b + stepSize, currentIteration);
-							tfr = generationFunction(a + stepSize, b + stepSize, currentIteration + stepSize);
-							tfl = generationFunction(a, b + stepSize, currentIteration + stepSize);
-
-							index = 0;
-							if (test(bbl)) index |= BOTTOM_BACK_LEFT;
-							if (test(bbr)) index |= BOTTOM_BACK_RIGHT;
-							if (test(bfr)) index |= BOTTOM_FRONT_RIGHT;
-							if (test(bfl)) index |= BOTTOM_FRONT_LEFT;
-							if (test(tbl)) index |= TOP_BACK_LEFT;
-							if (test(tbr)) index |= TOP_BACK_RIGHT;
-							if (test(tfr)) index |= TOP_FRONT_RIGHT;
-							if (test(tfl)) index |= TOP_FRONT_LEFT;
-
-							verts = marching_cubes_lut[index];
-							add_triangles(verts, a, b, currentIteration);
-							break;
-							
-					}
-				}
+	void emplace_back(T value){
+		append(&value, 1);
+	}
+
+	// Returns where the next n values go so they can be written in place, or nullptr if they would run past the end of
+	// the current page. The values are only counted once grow(n) is called.
+	T* tail(size_t n){
+		size_t offset = count % PAGE_SIZE;
+		if (offset + n > PAGE_SIZE) return nullptr;
+		if (offset == 0 && count / PAGE_SIZE == pages.size()){
+			pages.emplace_back(allocatePage());
+		}
+		return pages[count / PAGE_SIZE] + offset;
+	}
+	void grow(size_t n){
+		count += n;
+	}
+
+	// Empties the array but keeps its pages for reuse
+	void clear(){
+		count = 0;
+	}
+
+	// Moves the contents to the end of out a page at a time, freeing each page once it's copied, and empties the array.
+	// Pages past the end (kept by clear) hold nothing and are just freed.
+	void moveTo(std::vector<T>& out){
+		size_t used = (count + PAGE_SIZE - 1) / PAGE_SIZE;
+		for (size_t page = 0; page < pages.size(); page++){
+			if (page < used){
+				out.insert(out.end(), pages[page], pages[page] + std::min(PAGE_SIZE, count - page * PAGE_SIZE));
+			}
+			freePage(pages[page]);
+		}
+		pages.clear();
+		count = 0;
+	}
+};
+
+// Adds n values to the end of a vertex, index or normal list in one go
+template <typename T>
+void appendValues(std::vector<T>& out, const T* values, size_t n){
+	out.insert(out.end(), values, values + n);
+}
+template <typename T>
+void appendValues(PagedArray<T>& out, const T* values, size_t n){
+	out.append(values, n);
+}
+
+// Returns room for n values at the end of a list to write them in place, or nullptr if they have to be added with
+// appendValues instead. Vectors always use appendValues, since resizing one first would zero the values.
+template <typename T>
+T* appendSpace(std::vector<T>&, size_t){
+	return nullptr;
+}
+template <typename T>
+T* appendSpace(PagedArray<T>& out, size_t n){
+	return out.tail(n);
+}
+template <typename T>
+void appendWritten(std::vector<T>&, size_t){}
+template <typename T>
+void appendWritten(PagedArray<T>& out, size_t n){
+	out.grow(n);
+}
+
+// Makes room for n more values at the end of a vector, doubling its capacity like push_back would, so it isn't
+// reallocated part way through adding them
+template <typename T>
+void reserveMore(std::vector<T>& out, size_t n){
+	size_t needed = out.size() + n;
+	if (needed <= out.capacity()) return;
+	size_t capacity = std::max(out.capacity(), (size_t)1);
+	while (capacity < needed) capacity *= 2;
+	out.reserve(capacity);
+}
+
+// Part of the mesh made by one thread (a slab in Full mode or a brick in Chunked mode), laid out like MeshData.
+// The parts are copied into the MeshData once they're all done, when its final size is known.
+struct MeshPages{
+	PagedArray<float> vertices;
+	PagedArray<unsigned int> indices;
+	PagedArray<float> normalSums;
+	PagedArray<uint64_t> edgeKeys;
+};
+
+// Box of cubes processed together: cubes [start, start + cells) along each axis
+struct Region{
+	int start[3] = {0, 0, 0};
+	int cells[3] = {0, 0, 0};
+};
+
+// Cached samples of one plane of grid points, and which of them are inside (0xFF) or outside (0)
+struct SlicePlane{
+	std::vector<float> samples;
+	std::vector<uint8_t> inside;
+};
+
+// Vertex numbers of the cube edges touching one slice, used to weld vertices in indexed mode.
+// Each table has an entry per grid point of a plane (of the region being generated); -1 means no vertex has been made on that edge yet.
+struct SliceEdges{
+	enum Table{
+		LowerA,	// Edges along A in the lower plane
+		LowerB,	// Edges along B in the lower plane
+		UpperA,	// Edges along A in the upper plane
+		UpperB,	// Edges along B in the upper plane
+		Across	// Edges along the slicing axis between the two planes
+	};
+	std::vector<int> tables[5];
+
+	void reset(int size){
+		for (std::vector<int>& table : tables){
+			table.assign(size, -1);
+		}
+	}
+
+	// Moves on to the next slice: the upper plane becomes the lower plane
+	void advance(){
+		std::swap(tables[LowerA], tables[UpperA]);
+		std::swap(tables[LowerB], tables[UpperB]);
+		std::fill(tables[UpperA].begin(), tables[UpperA].end(), -1);
+		std::fill(tables[UpperB].begin(), tables[UpperB].end(), -1);
+		std::fill(tables[Across].begin(), tables[Across].end(), -1);
+	}
+};
+
+// Octree used by Adaptive mode. Node (level, i, j, k) is the cube at position (i, j, k) in the grid that splits the
+// volume into 2^level cubes along each axis. Every node is either a leaf or split into 8 children one level down.
+struct Octree{
+	static const int MAX_LEVEL = 16;	// Keeps lattice coordinates (see MarchingCubes::generateAdaptive) within their key bits
+	std::unordered_set<uint64_t> leaves;
+	std::unordered_set<uint64_t> split;
+
+	static uint64_t key(int level, int i, int j, int k){
+		return (uint64_t)level << 57 | (uint64_t)i << 38 | (uint64_t)j << 19 | (uint64_t)k;
+	}
+
+	static bool inside(int level, int i, int j, int k){
+		int count = 1 << level;
+		return i >= 0 && j >= 0 && k >= 0 && i < count && j < count && k < count;
+	}
+
+	bool isSplit(int level, int i, int j, int k) const{
+		return inside(level, i, j, k) && split.count(key(level, i, j, k)) > 0;
+	}
+
+	// Level of the leaf containing node (level, i, j, k), or -1 if the node is split into smaller leaves
+	int leafLevel(int level, int i, int j, int k) const{
+		for (int l = level; l >= 0; l--){
+			if (leaves.count(key(l, i >> (level - l), j >> (level - l), k >> (level - l)))) return l;
+		}
+		return -1;
+	}
+
+	// Turns a leaf into a split node with 8 leaf children
+	void splitLeaf(int level, int i, int j, int k){
+		leaves.erase(key(level, i, j, k));
+		split.insert(key(level, i, j, k));
+		for (int c = 0; c < 8; c++){
+			leaves.insert(key(level + 1, i * 2 + cornerOffsets[c][0], j * 2 + cornerOffsets[c][1], k * 2 + cornerOffsets[c][2]));
+		}
+	}
+};
+
+// Vertices on the faces between bricks in indexed Chunked mode, kept until every brick sharing them is done.
+// A vertex only gets its number in the output once its normal is final, so triangles using a seam vertex have to wait too.
+// Vertices and triangles are filed under the number of the brick after which they're finished.
+struct BrickSeams{
+	struct Vertex{
+		float position[3];
+		float normalSum[3] = {0, 0, 0};
+		unsigned int id = ~0u;	// Number in the output, once finished
+		int triangles = 0;		// Waiting triangles that use this vertex
+	};
+	// Each corner is an output vertex number, or the edge key of a seam vertex if its bit in seamCorners is set
+	struct Triangle{
+		uint64_t corners[3];
+		uint8_t seamCorners = 0;
+	};
+	std::unordered_map<uint64_t, Vertex> vertices;	// By edge key
+	std::unordered_map<int, std::vector<uint64_t>> finishedVertices;
+	std::unordered_map<int, std::vector<Triangle>> finishedTriangles;
+};
+
+// Profiling: compile with -DPROFILE to time each stage of generation, uploading and writing. PROFILE_SCOPE(stage)
+// times the rest of the enclosing block, and PROFILE_ITEMS(n) adds to the number of things it handled. Without
+// -DPROFILE both compile to nothing.
+#ifdef PROFILE
+enum ProfileStage{
+	ProfileSample,		// sampleSlice: function evaluation and empty-space tests for one plane
+	ProfileCases,		// Case indices of a slice of cubes
+	ProfileTriangles,	// Triangles of a slice of cubes
+	ProfileJoin,		// Joining a slab or brick onto the mesh
+	ProfileAdaptive,	// All of Adaptive mode's generation
+	ProfileNormals,		// Working out normals from the triangles or normal sums
+	ProfileUpload,		// Uploading new chunks to the GPU
+	ProfileWrite,		// Writing the PLY file
+	PROFILE_STAGES
+};
+
+struct ProfileStageInfo{
+	const char* name;
+	const char* items;	// What PROFILE_ITEMS counts
+};
+const ProfileStageInfo PROFILE_STAGE_INFO[PROFILE_STAGES] = {
+	{"sample", "points"},
+	{"cases", "cubes"},
+	{"triangles", "triangles"},
+	{"join", "vertices"},
+	{"adaptive", "triangles"},
+	{"normals", "vertices"},
+	{"upload", "bytes"},
+	{"write", "bytes"}
+};
+
+// Totals for each stage, added to by every thread, plus a Chrome trace (chrome://tracing) if it was turned on
+class Profiler{
+	struct Stage{
+		std::atomic<long long> nanoseconds{0};
+		std::atomic<long long> calls{0};
+		std::atomic<long long> items{0};
+	};
+	struct TraceEvent{
+		int stage;
+		int thread;
+		long long start;	// Microseconds since the program started
+		long long duration;
+	};
+	Stage stages[PROFILE_STAGES];
+	std::chrono::steady_clock::time_point origin = std::chrono::steady_clock::now();
+	std::atomic<int> threadCount{0};
+	bool tracing = false;
+	std::mutex traceMutex;
+	std::vector<TraceEvent> events;
+
+	int threadNumber(){
+		thread_local int number = threadCount++;
+		return number;
+	}
+
+public:
+	void enableTrace(){
+		tracing = true;
+	}
+
+	void add(ProfileStage stage, std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end, long long items){
+		long long nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+		stages[stage].nanoseconds += nanoseconds;
+		stages[stage].calls++;
+		stages[stage].items += items;
+		if (tracing){
+			long long startMicroseconds = std::chrono::duration_cast<std::chrono::microseconds>(start - origin).count();
+			std::lock_guard<std::mutex> lock(traceMutex);
+			events.push_back({stage, threadNumber(), startMicroseconds, nanoseconds / 1000});
+		}
+	}
+
+	// Prints the totals for every stage that was used. Times are added up over all threads.
+	void printSummary(){
+		printf("Profile (time added up over all threads):\n");
+		for (int i = 0; i < PROFILE_STAGES; i++){
+			long long calls = stages[i].calls;
+			if (calls == 0) continue;
+			double seconds = stages[i].nanoseconds / 1e9;
+			printf("  %-10s %9.3f s %10lld calls %10.2f us/call %14lld %s\n", PROFILE_STAGE_INFO[i].name, seconds, calls,
+				seconds * 1e6 / calls, (long long)stages[i].items, PROFILE_STAGE_INFO[i].items);
+		}
+	}
+
+	// Writes the trace as Chrome trace event JSON
+	void writeTrace(const std::string& filename){
+		FILE* file = fopen(filename.c_str(), "w");
+		if (file == NULL){
+			printf("Error creating trace file\n");
+			return;
+		}
+		std::lock_guard<std::mutex> lock(traceMutex);
+		fputs("{\"traceEvents\":[\n", file);
+		for (size_t i = 0; i < events.size(); i++){
+			const TraceEvent& event = events[i];
+			fprintf(file, "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":0,\"tid\":%d,\"ts\":%lld,\"dur\":%lld}%s\n", PROFILE_STAGE_INFO[event.stage].name,
+				event.thread, event.start, event.duration, i + 1 < events.size() ? "," : "");
+		}
+		fputs("]}\n", file);
+		fclose(file);
+		printf("Trace written to %s (%zu events)\n", filename.c_str(), events.size());
+	}
+};
+Profiler profiler;
+
+// Times the rest of the block it's made in
+class ProfileScope{
+	ProfileStage stage;
+	std::chrono::steady_clock::time_point start;
+public:
+	long long items = 0;
+
+	ProfileScope(ProfileStage s) : stage(s), start(std::chrono::steady_clock::now()) {}
+	~ProfileScope(){
+		profiler.add(stage, start, std::chrono::steady_clock::now(), items);
+	}
+};
+#define PROFILE_SCOPE(stage) ProfileScope profileScope(stage)
+#define PROFILE_ITEMS(n) (profileScope.items += (n))
+#else
+#define PROFILE_SCOPE(stage)
+#define PROFILE_ITEMS(n)
+#endif
+
+// Counters kept while generating. Each thread in Full and Chunked modes has its own, and they are added up at the end.
+struct GenerationStats{
+	long long evaluations = 0;		// Number of times the generation function has been called
+	long long blocksTested = 0;		// Blocks checked for empty space
+	long long blocksSkipped = 0;	// Blocks the surface can't pass through
+
+	void add(const GenerationStats& other){
+		evaluations += other.evaluations;
+		blocksTested += other.blocksTested;
+		blocksSkipped += other.blocksSkipped;
+	}
+};
+
+// Distances from points of the mesh to the surface (see MarchingCubes::measureMesh)
+struct SurfaceError{
+	double sum = 0;
+	double max = 0;
+	long long points = 0;
+
+	void add(double distance){
+		sum += distance;
+		max = std::max(max, distance);
+		points++;
+	}
+
+	double mean() const{
+		return points > 0 ? sum / points : 0;
+	}
+};
+
+// Block maps of the two most recently used layers of slices (see MarchingCubes::activeBlocks)
+struct BlockLayers{
+	int layers[2] = {-1, -1};
+	std::vector<uint8_t> active[2];
+	int next = 0;	// Slot to replace on the next miss
+};
+
+// Handles marching cubes mesh generation.
+// Function is the type of the generation function and Comparison is a CompareOperation (or RUNTIME_COMPARE).
+// Fixing both at compile time lets the compiler inline the function and the inside test into the sampling and cube loops;
+// MarchingCubes<> takes any function and comparator at run time instead.
+template <typename Function = GenericFunction, int Comparison = RUNTIME_COMPARE>
+class MarchingCubes{
+		CubesMode generationMode = Full;
+		CompareOperation comparator = Less;
+		Function generationFunction;
+		float isoValue = 0;
+		float minCoord = 0;
+		float maxCoord = 1;
+		float stepSize = 0.1;
+		std::atomic<int> currentSlice{0};
+		Grid grid;						// Grid points along each axis (same for all 3 axes)
+		SlicePlane lowerSlice;			// Cached samples for the two planes bounding the current slice
+		SlicePlane upperSlice;
+		SliceEdges sliceEdges;			// Welding tables for the current slice (indexed mode)
+		MeshData mesh;
+		std::vector<std::pair<size_t, size_t>> revisions;	// Vertex and index list lengths after each call to generate()
+		bool indexed = false;			// Weld shared vertices and output an index list
+		bool interpolate = false;		// Place vertices where the samples cross the iso value instead of at edge midpoints
+		bool measureError = false;		// Measure how far the mesh is from the surface (see measureMesh)
+		bool gradientNormals = false;	// Make the vertex normals from the function's gradient while generating (see cubeGradients)
+		SurfaceError vertexError;		// Distance from the surface at the vertices
+		SurfaceError centreError;		// Distance from the surface at the centres of the triangles
+		GenerationStats stats;
+		BlockLayers blockLayers;		// Empty-space skipping state for incremental modes
+		double generationSeconds = 0;	// Time spent in generate()
+		int threadCount = 1;			// Number of threads used in Full and Chunked modes
+		std::atomic<bool> cancelled{false};	// Set from another thread to stop generation early
+		static const int BLOCK_SIZE = 8;	// Cubes along each side of the blocks checked for empty space
+		Octree octree;					// Adaptive mode state (see generateAdaptive)
+		int maxLevel = 0;				// Level of the smallest cubes
+		int minLevel = 0;				// Level of the biggest cubes
+		float latticeStep = 0;			// Distance between lattice points, half the smallest step
+		float adaptiveError = 0.5f;		// Allowed error of the approximation, in smallest steps
+		std::unordered_map<uint64_t, float> latticeSamples;
+		int brickSize = 64;				// Cubes along each side of the bricks in Chunked mode (a multiple of BLOCK_SIZE)
+		BrickSeams seams;				// Vertices shared between bricks (indexed Chunked mode)
+		size_t droppedVertices = 0;		// Floats of the vertex list handed out and dropped from mesh (Chunked mode)
+		size_t droppedIndices = 0;		// Indices handed out and dropped from mesh (Chunked mode)
+		bool retainSamples = false;		// Keep every sampled plane so the iso value can be changed (see changeIsoValue)
+		std::vector<SlicePlane> retainedPlanes;	// Every plane along the slicing axis (see retainedAxis)
+		std::vector<Interval> blockBounds;	// Lowest and highest retained sample at the corners of each block, by layer, A and B
+
+		// Evaluates the generation function at count points given by the coordinate lists. Functions with their own
+		// evaluateRow() (ExpressionFunction) do the whole row themselves.
+		// Batch functions do WIDTH points at a time. The last few points of a row go through the batch version too
+		// (padded with copies of the last point), because the plain float version can round differently; that way a
+		// point gets the same value no matter where a row starts, e.g. at the edge of a brick in Chunked mode.
+		void evaluateRow(const float* xs, const float* ys, const float* zs, float* out, int count) const{
+			if constexpr (IsRowFunction<Function>::value){
+				generationFunction.evaluateRow(xs, ys, zs, out, count);
+				return;
+			}
+			int i = 0;
+			if constexpr (IsBatchFunction<Function>::value){
+				for (; i + FloatBatch::WIDTH <= count; i += FloatBatch::WIDTH){
+					generationFunction(FloatBatch::load(xs + i), FloatBatch::load(ys + i), FloatBatch::load(zs + i)).store(out + i);
+				}
+				if (i < count){
+					float x[FloatBatch::WIDTH], y[FloatBatch::WIDTH], z[FloatBatch::WIDTH], values[FloatBatch::WIDTH];
+					for (int j = 0; j < FloatBatch::WIDTH; j++){
+						int k = std::min(i + j, count - 1);
+						x[j] = xs[k];
+						y[j] = ys[k];
+						z[j] = zs[k];
+					}
+					generationFunction(FloatBatch::load(x), FloatBatch::load(y), FloatBatch::load(z)).store(values);
+					std::copy(values, values + count - i, out + i);
+					i = count;
+				}
+			}
+			for (; i < count; i++){
+				out[i] = generationFunction(xs[i], ys[i], zs[i]);
+			}
+		}
+
+		// Slicing axis of a mode and the other two axes (A and B), as 0 = X, 1 = Y, 2 = Z
+		static void sliceAxes(CubesMode axis, int& sliceAxis, int& aAxis, int& bAxis){
+			switch (axis){
+				case Incremental_X:
+					// A is Y, B is Z
+					sliceAxis = 0; aAxis = 1; bAxis = 2;
+					break;
+				case Incremental_Y:
+					// A is X, B is Z
+					sliceAxis = 1; aAxis = 0; bAxis = 2;
+					break;
+				default:
+					// A is X, B is Y
+					sliceAxis = 2; aAxis = 0; bAxis = 1;
+					break;
+			}
+		}
+
+		// The whole volume as a region
+		Region wholeVolume() const{
+			Region region;
+			for (int d = 0; d < 3; d++){
+				region.cells[d] = grid.cells;
+			}
+			return region;
+		}
+
+		// Number of blocks covering the given number of cubes
+		static int blockCount(int cells){
+			return (cells + BLOCK_SIZE - 1) / BLOCK_SIZE;
+		}
+
+		// Returns a map with a byte per block of the given layer of slices (BLOCK_SIZE slices thick) within the region:
+		// 1 if the surface might pass through the block, 0 if the bounds of the function over the block show it can't.
+		// Blocks start at the region's corner, which has to be on a multiple of BLOCK_SIZE along A and B so the blocks line up
+		// with the rest of the volume (along the slicing axis, layers are always counted from the start of the volume).
+		// Only functions that can be called with Intervals have bounds; with any other function every block is active.
+		// Maps are cached in layers, which holds the last two so the two layers around a plane can be used together.
+		const uint8_t* activeBlocks(CubesMode axis, const Region& region, int layer, BlockLayers& layers, GenerationStats& counters) const{
+			for (int slot = 0; slot < 2; slot++){
+				if (layers.layers[slot] == layer){
+					layers.next = 1 - slot;
+					return layers.active[slot].data();
+				}
+			}
+			int slot = layers.next;
+			layers.next = 1 - slot;
+			layers.layers[slot] = layer;
+			std::vector<uint8_t>& active = layers.active[slot];
+			int sliceAxis, aAxis, bAxis;
+			sliceAxes(axis, sliceAxis, aAxis, bAxis);
+			int aBlocks = blockCount(region.cells[aAxis]);
+			int bBlocks = blockCount(region.cells[bAxis]);
+			active.assign(aBlocks * bBlocks, 1);
+
+			// With retained samples the bounds are known exactly. Until then every point has to be sampled, so every block is active.
+			if (!blockBounds.empty()){
+				const Interval* bounds = &blockBounds[(size_t)layer * aBlocks * bBlocks];
+				for (int i = 0; i < aBlocks * bBlocks; i++){
+					if (test(bounds[i].lo) == test(bounds[i].hi)){
+						active[i] = 0;
+						counters.blocksSkipped++;
+					}
+					counters.blocksTested++;
+				}
+				return active.data();
+			}
+			if (retainSamples) return active.data();
+
+			if constexpr (IsIntervalFunction<Function>::value){
+				// Coordinates covered by a block along one axis of the region
+				auto range = [&](int d, int block){
+					int first = region.start[d] + block * BLOCK_SIZE;
+					return Interval(grid.coord(first), grid.coord(std::min(first + BLOCK_SIZE, region.start[d] + region.cells[d])));
+				};
+				Interval box[3] = {Interval(0), Interval(0), Interval(0)};
+				box[sliceAxis] = Interval(grid.coord(layer * BLOCK_SIZE), grid.coord(std::min((layer + 1) * BLOCK_SIZE, grid.cells)));
+				for (int ba = 0; ba < aBlocks; ba++){
+					box[aAxis] = range(aAxis, ba);
+					for (int bb = 0; bb < bBlocks; bb++){
+						box[bAxis] = range(bAxis, bb);
+						if (excludesSurface(generationFunction(box[0], box[1], box[2]))){
+							active[ba * bBlocks + bb] = 0;
+							counters.blocksSkipped++;
+						}
+						counters.blocksTested++;
+					}
+				}
+			}
+			return active.data();
+		}
+
+		// Samples the generation function on the region's part of one plane and marks which points are inside.
+		// Only points that are corners of cubes in active blocks (on either side of the plane) are sampled; the rest
+		// of the plane is left as it was, since those cubes are skipped.
+		// The plane is perpendicular to the slicing axis of the given mode; A and B are the other two axes.
+		// Only reads member state, so several threads can sample different planes at once.
+		void sampleSlice(CubesMode axis, const Region& region, int index, SlicePlane& plane, BlockLayers& layers, GenerationStats& counters) const{
+			PROFILE_SCOPE(ProfileSample);
+			int sliceAxis, aAxis, bAxis;
+			sliceAxes(axis, sliceAxis, aAxis, bAxis);
+			int aPoints = region.cells[aAxis] + 1;
+			int bPoints = region.cells[bAxis] + 1;
+			int bBlocks = blockCount(region.cells[bAxis]);
+			std::vector<float> bCoord(bPoints), sliceCoord(bPoints, grid.coord(index)), aCoord(bPoints);
+			for (int i = 0; i < bPoints; i++){
+				bCoord[i] = grid.coord(region.start[bAxis] + i);
+			}
+			// Coordinate lists along a row, by axis
+			const float* coords[3];
+			coords[sliceAxis] = sliceCoord.data();
+			coords[aAxis] = aCoord.data();
+			coords[bAxis] = bCoord.data();
+			plane.samples.resize(aPoints * bPoints);
+
+			// Blocks of the slices below and above the plane
+			const uint8_t* sides[2] = {nullptr, nullptr};
+			if (index > region.start[sliceAxis]) sides[0] = activeBlocks(axis, region, (index - 1) / BLOCK_SIZE, layers, counters);
+			if (index < region.start[sliceAxis] + region.cells[sliceAxis]) sides[1] = activeBlocks(axis, region, index / BLOCK_SIZE, layers, counters);
+			std::vector<uint8_t> needed(bBlocks);
+
+			// Each row has a fixed A coordinate, and B runs along it
+			for (int a = 0; a < aPoints; a++){
+				// Columns of blocks along B with an active block touching this row
+				std::fill(needed.begin(), needed.end(), 0);
+				for (int cube = a - 1; cube <= a; cube++){
+					if (cube < 0 || cube >= aPoints - 1) continue;
+					for (const uint8_t* side : sides){
+						if (side == nullptr) continue;
+						for (int bb = 0; bb < bBlocks; bb++){
+							needed[bb] |= side[(cube / BLOCK_SIZE) * bBlocks + bb];
+						}
+					}
+				}
+
+				std::fill(aCoord.begin(), aCoord.end(), grid.coord(region.start[aAxis] + a));
+				float* row = &plane.samples[a * bPoints];
+				for (int bb = 0; bb < bBlocks; bb++){
+					if (!needed[bb]) continue;
+					// Sample a run of needed blocks in one go, including the points on the far edge of the last one
+					int first = bb * BLOCK_SIZE;
+					while (bb + 1 < bBlocks && needed[bb + 1]) bb++;
+					int count = std::min((bb + 1) * BLOCK_SIZE, bPoints - 1) + 1 - first;
+					evaluateRow(coords[0] + first, coords[1] + first, coords[2] + first, row + first, count);
+					counters.evaluations += count;
+					PROFILE_ITEMS(count);
+				}
+			}
+			classify(plane);
+		}
+
+		// Fills in the inside mask of a sampled plane, a batch of points at a time
+		void classify(SlicePlane& plane) const{
+			int count = plane.samples.size();
+			plane.inside.resize(count);
+			FloatBatch iso(isoValue);
+			int i = 0;
+			for (; i + FloatBatch::WIDTH <= count; i += FloatBatch::WIDTH){
+				FloatBatch value = FloatBatch::load(&plane.samples[i]);
+				switch (Comparison == RUNTIME_COMPARE ? comparator : (CompareOperation)Comparison){
+					case Less:
+						(value < iso).storeMask(&plane.inside[i]);
+						break;
+					case LessEqual:
+						(value <= iso).storeMask(&plane.inside[i]);
+						break;
+					case Greater:
+						(value > iso).storeMask(&plane.inside[i]);
+						break;
+					case GreaterEqual:
+						(value >= iso).storeMask(&plane.inside[i]);
+						break;
+				}
+			}
+			for (; i < count; i++){
+				plane.inside[i] = test(plane.samples[i]) ? 0xFF : 0;
+			}
+		}
+
+		// Moves the vertex on each edge the surface crosses from the midpoint to where the linear interpolation of the
+		// samples at its corners crosses the iso value. values has the sample at each corner, and edgePoints the position
+		// of each edge's vertex within the cube. The ends of an edge are always taken in the same order, so the cubes
+		// sharing an edge get the same point.
+		void interpolateEdges(int cubeIndex, const float* values, float (*edgePoints)[3]) const{
+			for (int e = 0; e < 12; e++){
+				int c0 = edgeCorners[e][0];
+				int c1 = edgeCorners[e][1];
+				if (!(cubeIndex & cornerBits[c0]) == !(cubeIndex & cornerBits[c1])) continue;
+				float t = values[c0] != values[c1] ? std::min(std::max((isoValue - values[c0]) / (values[c1] - values[c0]), 0.0f), 1.0f) : 0.5f;
+				for (int d = 0; d < 3; d++){
+					if (cornerOffsets[c0][d] != cornerOffsets[c1][d]) edgePoints[e][d] = t;
+				}
+			}
+		}
+
+		// Normals point up the gradient when the inside is below the iso value, and down it otherwise
+		float outwardSign() const{
+			return comparator == Less || comparator == LessEqual ? 1.0f : -1.0f;
+		}
+
+		// Works out the normal at the vertex on each edge used by a cube's triangles (verts) for gradient normals.
+		// Functions with a gradient() use it at the vertex. Otherwise the gradient of the trilinear interpolation of the
+		// cube's corner samples (values) is used, which needs no extra function calls. Across the cube faces that's a
+		// one-sided difference, but in indexed mode every cube using a vertex adds its own, which evens out into a
+		// central difference.
+		void cubeGradients(const uint8_t* verts, int triangles, const int* cube, const float* values, const float (*edgePoints)[3], float (*gradients)[3]) const{
+			float sign = outwardSign();
+			int done = 0;	// Edges already worked out
+			for (int i = 0; i < triangles * 3; i++){
+				int edge = verts[i];
+				if (done & (1 << edge)) continue;
+				done |= 1 << edge;
+				const float* p = edgePoints[edge];
+				glm::vec3 gradient(0.0f);
+				if constexpr (HasGradient<Function>::value){
+					gradient = generationFunction.gradient(grid.coord(cube[0]) + stepSize * p[0], grid.coord(cube[1]) + stepSize * p[1], grid.coord(cube[2]) + stepSize * p[2]);
+				}
+				else{
+					for (int c = 0; c < 8; c++){
+						const int* o = cornerOffsets[c];
+						float w[3] = {o[0] ? p[0] : 1 - p[0], o[1] ? p[1] : 1 - p[1], o[2] ? p[2] : 1 - p[2]};
+						gradient.x += values[c] * (o[0] ? 1 : -1) * w[1] * w[2];
+						gradient.y += values[c] * (o[1] ? 1 : -1) * w[0] * w[2];
+						gradient.z += values[c] * (o[2] ? 1 : -1) * w[0] * w[1];
+					}
+					gradient = gradient * (1.0f / stepSize);
+				}
+				for (int d = 0; d < 3; d++){
+					gradients[edge][d] = gradient[d] * sign;
+				}
+			}
+		}
+
+		// Runs marching cubes over the region's part of one slice of cubes using the cached samples of its two bounding planes.
+		// Cubes in blocks that aren't active (see activeBlocks) are skipped.
+		// In indexed mode, edges holds the welding tables for this slice.
+		// out is the whole mesh (MeshData) in incremental modes, or a thread's own part of it (MeshPages).
+		template <typename Mesh>
+		void marchSlice(CubesMode axis, const Region& region, int index, const SlicePlane& lower, const SlicePlane& upper, const uint8_t* active, Mesh& out, SliceEdges& edges) const{
+			int sliceAxis, aAxis, bAxis;
+			sliceAxes(axis, sliceAxis, aAxis, bAxis);
+			int aCells = region.cells[aAxis];
+			int bCells = region.cells[bAxis];
+			int points = bCells + 1;	// Points along each row of the planes
+			int blocks = blockCount(bCells);
+			const SlicePlane* planes[2] = {&lower, &upper};
+			const uint8_t* corners[8];
+			std::vector<uint8_t> cases((size_t)aCells * bCells);
+			int index3[3];
+			int cornerSample[8];
+			int cornerPlane[8];
+			int edgeTable[12];
+			int edgeSample[12];
+			int cubeIndex;
+			float values[8];
+			float edgePoints[12][3];
+			float gradients[12][3];
+			memcpy(edgePoints, vertTable, sizeof(edgePoints));
+
+			// Position of each corner within the two cached planes
+			for (int c = 0; c < 8; c++){
+				cornerPlane[c] = cornerOffsets[c][sliceAxis];
+				cornerSample[c] = cornerOffsets[c][aAxis] * points + cornerOffsets[c][bAxis];
+			}
+
+			// Welding table and position within it of each cube edge.
+			// An edge's direction is the axis where its midpoint in vertTable is 0.5, and it starts at the other two coordinates.
+			for (int e = 0; e < 12; e++){
+				int offset[3];
+				int direction = 0;
+				for (int d = 0; d < 3; d++){
+					offset[d] = vertTable[e][d] == 1.0f ? 1 : 0;
+					if (vertTable[e][d] == 0.5f) direction = d;
+				}
+				if (direction == sliceAxis)
+					edgeTable[e] = SliceEdges::Across;
+				else if (offset[sliceAxis] == 0)
+					edgeTable[e] = direction == aAxis ? SliceEdges::LowerA : SliceEdges::LowerB;
+				else
+					edgeTable[e] = direction == aAxis ? SliceEdges::UpperA : SliceEdges::UpperB;
+				edgeSample[e] = offset[aAxis] * points + offset[bAxis];
+			}
+
+			// Work out the case indices a whole row of cubes at a time from the corners' inside masks
+			{
+				PROFILE_SCOPE(ProfileCases);
+				PROFILE_ITEMS((long long)aCells * bCells);
+				for (int a = 0; a < aCells; a++){
+					// Rows without an active block are skipped below, so they don't need cases
+					const uint8_t* activeRow = active + (a / BLOCK_SIZE) * blocks;
+					if (std::find(activeRow, activeRow + blocks, 1) == activeRow + blocks) continue;
+					for (int c = 0; c < 8; c++){
+						corners[c] = planes[cornerPlane[c]]->inside.data() + a * points + cornerSample[c];
+					}
+					buildCases(corners, &cases[(size_t)a * bCells], bCells);
+				}
+			}
+
+			// The whole mesh is one list in incremental modes, so count the slice's triangles and make room for them first.
+			// Indexed meshes have about half as many vertices as triangles.
+			if constexpr (std::is_same<Mesh, MeshData>::value){
+				size_t triangles = 0;
+				for (int a = 0; a < aCells; a++){
+					const uint8_t* rowCases = &cases[(size_t)a * bCells];
+					const uint8_t* activeRow = active + (a / BLOCK_SIZE) * blocks;
+					for (int bb = 0; bb < blocks; bb++){
+						if (!activeRow[bb]) continue;
+						int end = std::min((bb + 1) * BLOCK_SIZE, bCells);
+						for (int b = bb * BLOCK_SIZE; b < end; b++){
+							triangles += triangleCounts[rowCases[b]];
+						}
+					}
+				}
+				size_t floats = indexed ? triangles * 3 / 2 : triangles * 9;
+				reserveMore(out.vertices, floats);
+				if (indexed) reserveMore(out.indices, triangles * 3);
+				if (indexed || gradientNormals) reserveMore(out.normalSums, floats);
+			}
+
+			PROFILE_SCOPE(ProfileTriangles);
+			PROFILE_ITEMS(-(long long)(indexed ? out.indices.size() : out.vertices.size() / 3) / 3);
+			index3[sliceAxis] = index;
+			for (int a = 0; a < aCells; a++){
+				const uint8_t* rowCases = &cases[(size_t)a * bCells];
+				const uint8_t* activeRow = active + (a / BLOCK_SIZE) * blocks;
+				for (int bb = 0; bb < blocks; bb++){
+					if (!activeRow[bb]) continue;
+					int end = std::min((bb + 1) * BLOCK_SIZE, bCells);
+					for (int b = bb * BLOCK_SIZE; b < end; b++){
+						// Cubes entirely inside or outside have no triangles
+						cubeIndex = rowCases[b];
+						int triangles = triangleCounts[cubeIndex];
+						if (triangles == 0) continue;
+						int base = a * points + b;
+
+						index3[aAxis] = region.start[aAxis] + a;
+						index3[bAxis] = region.start[bAxis] + b;
+						if (interpolate || gradientNormals){
+							for (int c = 0; c < 8; c++){
+								values[c] = planes[cornerPlane[c]]->samples[base + cornerSample[c]];
+							}
+						}
+						if (interpolate){
+							interpolateEdges(cubeIndex, values, edgePoints);
+						}
+						const uint8_t* verts = marching_cubes_lut[cubeIndex];
+						if (gradientNormals){
+							cubeGradients(verts, triangles, index3, values, edgePoints, gradients);
+						}
+						if (indexed){
+							add_indexed_triangles(verts, triangles, index3, edgePoints, gradientNormals ? gradients : nullptr, base, edgeTable, edgeSample, edges, out);
+						}
+						else{
+							add_triangles(verts, triangles, grid.coord(index3[0]), grid.coord(index3[1]), grid.coord(index3[2]), edgePoints, out.vertices);
+							if (gradientNormals){
+								float normals[15 * 3];
+								for (int i = 0; i < triangles * 3; i++){
+									std::copy(gradients[verts[i]], gradients[verts[i]] + 3, normals + i * 3);
+								}
+								appendValues(out.normalSums, normals, triangles * 9);
+							}
+						}
+					}
+				}
+			}
+			PROFILE_ITEMS((long long)(indexed ? out.indices.size() : out.vertices.size() / 3) / 3);
+		}
+
+		// Generates the region one X slice at a time into its own mesh.
+		// Each thread in Full mode runs one of these on its own slab of the volume, and Chunked mode runs one per brick.
+		// In indexed mode, firstPlane and lastPlane (if given) get the welding tables for the region's two outside X planes
+		// (A and B tables in that order) so slabs can be stitched back together.
+		// If retained is given, the samples of each X plane are moved into it once they're used; the last plane is only kept
+		// by the slab at the end of the volume, since the next slab has its own copy of the others' last plane.
+		void generateSlab(const Region& region, MeshPages& out, GenerationStats& counters, std::vector<int>* firstPlane, std::vector<int>* lastPlane, std::vector<SlicePlane>* retained) const{
+			SlicePlane lower, upper;
+			SliceEdges edges;
+			BlockLayers layers;
+			int begin = region.start[0];
+			int end = begin + region.cells[0];
+			edges.reset((region.cells[1] + 1) * (region.cells[2] + 1));
+
+			// Walk along the X axis so the cubes come out in the same order as the X slices
+			sampleSlice(Incremental_X, region, begin, lower, layers, counters);
+			for (int x = begin; x < end && !cancelled; x++){
+				sampleSlice(Incremental_X, region, x + 1, upper, layers, counters);
+				marchSlice(Incremental_X, region, x, lower, upper, activeBlocks(Incremental_X, region, x / BLOCK_SIZE, layers, counters), out, edges);
+				if (retained != nullptr) (*retained)[x] = std::move(lower);
+				std::swap(lower, upper);
+				if (firstPlane != nullptr && indexed && x == begin){
+					firstPlane[0] = edges.tables[SliceEdges::LowerA];
+					firstPlane[1] = edges.tables[SliceEdges::LowerB];
+				}
+				edges.advance();
+			}
+			if (lastPlane != nullptr && indexed){
+				lastPlane[0] = edges.tables[SliceEdges::LowerA];
+				lastPlane[1] = edges.tables[SliceEdges::LowerB];
+			}
+			if (retained != nullptr && end == grid.cells && !cancelled) (*retained)[end] = std::move(lower);
+		}
+
+		// Generates the entire mesh (non-incremental)
+		void generateFull(){
+			int cells = grid.cells;
+			int threads = std::max(1, std::min(threadCount, cells));
+			std::vector<MeshPages> slabMeshes(threads);
+			std::vector<GenerationStats> slabStats(threads);
+			std::vector<std::vector<int>> firstPlanes(threads * 2), lastPlanes(threads * 2);
+			std::vector<std::thread> workers;
+			std::vector<SlicePlane>* retained = retainSamples ? &retainedPlanes : nullptr;
+			auto startTime = std::chrono::steady_clock::now();
+			if (retainSamples) retainedPlanes.resize(grid.points());
+
+			// Split the volume into one slab of X slices per thread. Slab i covers [cells * i / threads, cells * (i + 1) / threads)
+			std::vector<Region> slabs(threads, wholeVolume());
+			for (int i = 0; i < threads; i++){
+				slabs[i].start[0] = cells * i / threads;
+				slabs[i].cells[0] = cells * (i + 1) / threads - slabs[i].start[0];
+			}
+			for (int i = 1; i < threads; i++){
+				workers.emplace_back(&MarchingCubes::generateSlab, this, std::cref(slabs[i]), std::ref(slabMeshes[i]), std::ref(slabStats[i]), &firstPlanes[i * 2], &lastPlanes[i * 2], retained);
+			}
+			generateSlab(slabs[0], slabMeshes[0], slabStats[0], &firstPlanes[0], &lastPlanes[0], retained);
+			for (std::thread& worker : workers){
+				worker.join();
+			}
+
+			// Join the slabs in order so the output matches the single-threaded version.
+			// The sizes are known now, so the lists are only allocated once.
+			size_t total = mesh.vertices.size();
+			size_t totalIndices = mesh.indices.size();
+			for (int i = 0; i < threads; i++){
+				total += slabMeshes[i].vertices.size();
+				totalIndices += slabMeshes[i].indices.size();
+			}
+			mesh.vertices.reserve(total);
+			mesh.indices.reserve(totalIndices);
+			if (indexed || gradientNormals){
+				mesh.normalSums.reserve(total);
+			}
+			std::vector<unsigned int> previousRemap;
+			for (int i = 0; i < threads; i++){
+				if (indexed){
+					previousRemap = appendSlab(slabMeshes[i], i > 0 ? &lastPlanes[(i - 1) * 2] : nullptr, &firstPlanes[i * 2], previousRemap);
+				}
+				else{
+					slabMeshes[i].vertices.moveTo(mesh.vertices);
+					slabMeshes[i].normalSums.moveTo(mesh.normalSums);
+				}
+				slabMeshes[i] = MeshPages();
+				stats.add(slabStats[i]);
+			}
+			finished = true;
+
+			std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - startTime;
+			std::cout << "Generated mesh in " << elapsed.count() << " s using " << threads << " thread(s)" << std::endl;
+		}
+
+		// Appends an indexed slab to the mesh and returns the new number of each of its vertices.
+		// Vertices on the plane shared with the previous slab were made by both slabs; the copies in this slab
+		// are dropped and their triangles use the previous slab's vertices instead.
+		// The slab is emptied.
+		std::vector<unsigned int> appendSlab(MeshPages& slab, const std::vector<int>* previousLast, const std::vector<int>* first, const std::vector<unsigned int>& previousRemap){
+			PROFILE_SCOPE(ProfileJoin);
+			PROFILE_ITEMS(slab.vertices.size() / 3);
+			const unsigned int unassigned = ~0u;
+			std::vector<unsigned int> remap(slab.vertices.size() / 3, unassigned);
+
+			// Nothing to weld to in an empty mesh, so the vertex numbers stay the same and the lists are moved over whole,
+			// freeing each page as it goes
+			if (previousLast == nullptr && mesh.vertices.empty()){
+				for (size_t v = 0; v < remap.size(); v++){
+					remap[v] = v;
+				}
+				slab.vertices.moveTo(mesh.vertices);
+				slab.normalSums.moveTo(mesh.normalSums);
+				slab.indices.moveTo(mesh.indices);
+				return remap;
+			}
+
+			if (previousLast != nullptr){
+				for (int t = 0; t < 2; t++){
+					for (size_t i = 0; i < first[t].size(); i++){
+						if (first[t][i] >= 0 && previousLast[t][i] >= 0){
+							unsigned int shared = previousRemap[previousLast[t][i]];
+							remap[first[t][i]] = shared;
+							for (int k = 0; k < 3; k++){
+								mesh.normalSums[shared * 3 + k] += slab.normalSums[first[t][i] * 3 + k];
+							}
+						}
+					}
+				}
+			}
+
+			for (size_t v = 0; v < remap.size(); v++){
+				if (remap[v] == unassigned){
+					remap[v] = mesh.vertices.size() / 3;
+					for (int k = 0; k < 3; k++){
+						mesh.vertices.push_back(slab.vertices[v * 3 + k]);
+						mesh.normalSums.push_back(slab.normalSums[v * 3 + k]);
+					}
+				}
+			}
+			for (size_t i = 0; i < slab.indices.size(); i++){
+				mesh.indices.push_back(remap[slab.indices[i]]);
+			}
+			return remap;
+		}
+
+		// Generates one slice of the mesh
+		void generateIterative(){
+			int cells = grid.cells;
+			Region volume = wholeVolume();
+
+			// The upper plane of the previous slice is the lower plane of this one, so only the first slice samples both
+			if (currentSlice == 0){
+				sampleSlice(generationMode, volume, 0, lowerSlice, blockLayers, stats);
+				sliceEdges.reset(grid.points() * grid.points());
+				if (retainSamples) retainedPlanes.resize(grid.points());
+			}
+			sampleSlice(generationMode, volume, currentSlice + 1, upperSlice, blockLayers, stats);
+			marchSlice(generationMode, volume, currentSlice, lowerSlice, upperSlice, activeBlocks(generationMode, volume, currentSlice / BLOCK_SIZE, blockLayers, stats), mesh, sliceEdges);
+			if (retainSamples) retainedPlanes[currentSlice] = std::move(lowerSlice);
+			std::swap(lowerSlice, upperSlice);
+			sliceEdges.advance();
+
+			currentSlice++;
+			if (currentSlice >= cells || cancelled){
+				if (retainSamples && !cancelled) retainedPlanes[cells] = std::move(lowerSlice);
+				finished = true;
+			}
+		}
+
+		// Slicing axis of the retained planes: Full mode samples along X
+		CubesMode retainedAxis() const{
+			return generationMode == Full ? Incremental_X : generationMode;
+		}
+
+		// Works out blockBounds from the retained planes. A point on the boundary between two blocks is a corner of both.
+		void computeBlockBounds(){
+			int cells = grid.cells;
+			int points = grid.points();
+			int blocks = blockCount(cells);
+			// Blocks along one axis that have point p as a corner
+			auto blocksOf = [&](int p, int* out){
+				int count = 0;
+				if (p / BLOCK_SIZE < blocks) out[count++] = p / BLOCK_SIZE;
+				if (p % BLOCK_SIZE == 0 && p > 0) out[count++] = p / BLOCK_SIZE - 1;
+				return count;
+			};
+			blockBounds.assign((size_t)blocks * blocks * blocks, Interval(INFINITY, -INFINITY));
+			std::vector<Interval> rowBounds(blocks);
+			for (int p = 0; p < points; p++){
+				int layers[2];
+				int layerCount = blocksOf(p, layers);
+				for (int a = 0; a < points; a++){
+					const float* row = &retainedPlanes[p].samples[(size_t)a * points];
+					for (int bb = 0; bb < blocks; bb++){
+						int first = bb * BLOCK_SIZE;
+						int last = std::min(first + BLOCK_SIZE, cells);
+						Interval bounds(row[first]);
+						for (int b = first + 1; b <= last; b++){
+							bounds.lo = std::min(bounds.lo, row[b]);
+							bounds.hi = std::max(bounds.hi, row[b]);
+						}
+						rowBounds[bb] = bounds;
+					}
+					int aBlocks[2];
+					int aCount = blocksOf(a, aBlocks);
+					for (int l = 0; l < layerCount; l++){
+						for (int i = 0; i < aCount; i++){
+							Interval* out = &blockBounds[((size_t)layers[l] * blocks + aBlocks[i]) * blocks];
+							for (int bb = 0; bb < blocks; bb++){
+								out[bb].lo = std::min(out[bb].lo, rowBounds[bb].lo);
+								out[bb].hi = std::max(out[bb].hi, rowBounds[bb].hi);
+							}
+						}
+					}
+				}
+			}
+		}
+
+		// Number of bricks along each axis in Chunked mode
+		int brickCount() const{
+			return (grid.cells + brickSize - 1) / brickSize;
+		}
+
+		// Brick number n covers the cubes of the bricks at (n / count^2, n / count % count, n % count) along X, Y and Z
+		Region brickRegion(int brick) const{
+			int count = brickCount();
+			int position[3] = {brick / (count * count), brick / count % count, brick % count};
+			Region region;
+			for (int d = 0; d < 3; d++){
+				region.start[d] = position[d] * brickSize;
+				region.cells[d] = std::min(brickSize, grid.cells - region.start[d]);
+			}
+			return region;
+		}
+
+		// Grid point an edge key (see edgeKey) starts at, along axis d
+		static int edgePoint(uint64_t key, int d){
+			return (int)(key >> (40 - 20 * d)) & 0xFFFFF;
+		}
+
+		// True if an edge is on a face the region shares with another brick
+		bool onSeam(uint64_t key, const Region& region) const{
+			int direction = (int)(key >> 60);
+			for (int d = 0; d < 3; d++){
+				if (d == direction) continue;
+				int p = edgePoint(key, d);
+				if ((p == region.start[d] && p > 0) || (p == region.start[d] + region.cells[d] && p < grid.cells)) return true;
+			}
+			return false;
+		}
+
+		// Number of the last brick (in generation order) with a cube touching an edge
+		int lastBrick(uint64_t key) const{
+			int count = brickCount();
+			int brick = 0;
+			for (int d = 0; d < 3; d++){
+				brick = brick * count + std::min(edgePoint(key, d), grid.cells - 1) / brickSize;
+			}
+			return brick;
+		}
+
+		// Adds a brick's part of an indexed mesh to the output. Vertices inside the brick are finished, so they get their
+		// output numbers straight away. Vertices on a seam with other bricks are welded through seams and held (with any
+		// triangles using them) until the last brick sharing them is done, because those bricks still add to their normals.
+		void appendBrick(const MeshPages& brickMesh, const Region& region, int brick){
+			PROFILE_SCOPE(ProfileJoin);
+			PROFILE_ITEMS(brickMesh.vertices.size() / 3);
+			const unsigned int unassigned = ~0u;
+			std::vector<unsigned int> ids(brickMesh.vertices.size() / 3, unassigned);
+			for (size_t v = 0; v < ids.size(); v++){
+				uint64_t key = brickMesh.edgeKeys[v];
+				if (onSeam(key, region)){
+					auto inserted = seams.vertices.try_emplace(key);
+					BrickSeams::Vertex& vertex = inserted.first->second;
+					if (inserted.second){
+						for (int k = 0; k < 3; k++){
+							vertex.position[k] = brickMesh.vertices[v * 3 + k];
+						}
+						seams.finishedVertices[lastBrick(key)].emplace_back(key);
+					}
+					for (int k = 0; k < 3; k++){
+						vertex.normalSum[k] += brickMesh.normalSums[v * 3 + k];
+					}
+				}
+				else{
+					ids[v] = getVertexCount() / 3;
+					for (int k = 0; k < 3; k++){
+						mesh.vertices.push_back(brickMesh.vertices[v * 3 + k]);
+						mesh.normalSums.push_back(brickMesh.normalSums[v * 3 + k]);
+					}
+				}
+			}
+
+			for (size_t i = 0; i + 2 < brickMesh.indices.size(); i += 3){
+				BrickSeams::Triangle triangle;
+				int finishedAfter = brick;
+				for (int j = 0; j < 3; j++){
+					unsigned int local = brickMesh.indices[i + j];
+					if (ids[local] != unassigned){
+						triangle.corners[j] = ids[local];
+					}
+					else{
+						uint64_t key = brickMesh.edgeKeys[local];
+						triangle.corners[j] = key;
+						triangle.seamCorners |= 1 << j;
+						seams.vertices[key].triangles++;
+						finishedAfter = std::max(finishedAfter, lastBrick(key));
+					}
+				}
+				if (triangle.seamCorners == 0){
+					for (int j = 0; j < 3; j++){
+						mesh.indices.emplace_back((unsigned int)triangle.corners[j]);
+					}
+				}
+				else{
+					seams.finishedTriangles[finishedAfter].emplace_back(triangle);
+				}
+			}
+
+			// Hand out the seam vertices and triangles this brick was the last one waiting for
+			auto finishedVertices = seams.finishedVertices.find(brick);
+			if (finishedVertices != seams.finishedVertices.end()){
+				for (uint64_t key : finishedVertices->second){
+					BrickSeams::Vertex& vertex = seams.vertices.at(key);
+					vertex.id = getVertexCount() / 3;
+					mesh.vertices.insert(mesh.vertices.end(), vertex.position, vertex.position + 3);
+					mesh.normalSums.insert(mesh.normalSums.end(), vertex.normalSum, vertex.normalSum + 3);
+				}
+				seams.finishedVertices.erase(finishedVertices);
+			}
+			auto finishedTriangles = seams.finishedTriangles.find(brick);
+			if (finishedTriangles != seams.finishedTriangles.end()){
+				for (const BrickSeams::Triangle& triangle : finishedTriangles->second){
+					for (int j = 0; j < 3; j++){
+						if (!(triangle.seamCorners & (1 << j))){
+							mesh.indices.emplace_back((unsigned int)triangle.corners[j]);
+							continue;
+						}
+						// A seam vertex is forgotten once every triangle using it has been handed out
+						auto found = seams.vertices.find(triangle.corners[j]);
+						mesh.indices.emplace_back(found->second.id);
+						if (--found->second.triangles == 0) seams.vertices.erase(found);
+					}
+				}
+				seams.finishedTriangles.erase(finishedTriangles);
+			}
+		}
+
+		// Generates the next bricks of the mesh (Chunked mode), one per thread, and adds them to the mesh in order.
+		// The mesh only keeps what this call adds: everything from earlier calls has already been handed out (see
+		// getChanges) and is dropped, so memory use depends on the brick size instead of the size of the mesh.
+		void generateBricks(){
+			droppedVertices += mesh.vertices.size();
+			droppedIndices += mesh.indices.size();
+			mesh.vertices.clear();
+			mesh.indices.clear();
+			mesh.normalSums.clear();
+
+			int total = brickCount() * brickCount() * brickCount();
+			int first = currentSlice;
+			int bricks = std::max(1, std::min(threadCount, total - first));
+			std::vector<Region> regions(bricks);
+			std::vector<MeshPages> brickMeshes(bricks);
+			std::vector<GenerationStats> brickStats(bricks);
+			std::vector<std::thread> workers;
+			for (int i = 0; i < bricks; i++){
+				regions[i] = brickRegion(first + i);
+			}
+			for (int i = 1; i < bricks; i++){
+				workers.emplace_back(&MarchingCubes::generateSlab, this, std::cref(regions[i]), std::ref(brickMeshes[i]), std::ref(brickStats[i]), nullptr, nullptr, nullptr);
+			}
+			generateSlab(regions[0], brickMeshes[0], brickStats[0], nullptr, nullptr, nullptr);
+			for (std::thread& worker : workers){
+				worker.join();
+			}
+
+			for (int i = 0; i < bricks; i++){
+				if (indexed){
+					appendBrick(brickMeshes[i], regions[i], first + i);
+				}
+				else{
+					brickMeshes[i].vertices.moveTo(mesh.vertices);
+					brickMeshes[i].normalSums.moveTo(mesh.normalSums);
+				}
+				stats.add(brickStats[i]);
+			}
+
+			currentSlice += bricks;
+			if (currentSlice >= total || cancelled){
+				finished = true;
+			}
+		}
+
+		// Adaptive mode works on a lattice of points with 2^(maxLevel + 1) spaces along each axis, so that the corners,
+		// face centres and centres of the smallest cubes are all lattice points
+		uint64_t latticeKey(glm::ivec3 p) const{
+			return (uint64_t)p.x << 36 | (uint64_t)p.y << 18 | (uint64_t)p.z;
+		}
+
+		// Returns the function's value at a lattice point, evaluating it only the first time
+		float latticeSample(glm::ivec3 p){
+			uint64_t key = latticeKey(p);
+			auto found = latticeSamples.find(key);
+			if (found != latticeSamples.end()) return found->second;
+			float value = generationFunction(minCoord + p.x * latticeStep, minCoord + p.y * latticeStep, minCoord + p.z * latticeStep);
+			stats.evaluations++;
+			latticeSamples.emplace(key, value);
+			return value;
+		}
+
+		// Outward normal at an Adaptive mode vertex for gradient normals, with differences a lattice space wide
+		glm::vec3 vertexGradient(glm::vec3 p){
+			if (!HasGradient<Function>::value) stats.evaluations += 6;
+			return functionGradient(p, latticeStep) * outwardSign();
+		}
+
+		// Size of an octree node in lattice spaces
+		int nodeSize(int level) const{
+			return 1 << (maxLevel - level + 1);
+		}
+
+		// Decides whether an octree node needs smaller cubes: the surface has to pass through it, and trilinear
+		// interpolation of its corners has to be further than adaptiveError finest steps from the function.
+		bool shouldSplit(int level, int i, int j, int k){
+			if (level >= maxLevel) return false;
+			if (level < minLevel) return true;
+			int size = nodeSize(level);
+			glm::ivec3 origin(i * size, j * size, k * size);
+			bool mightCross = false;
+			if constexpr (IsIntervalFunction<Function>::value){
+				auto range = [&](int start){
+					return Interval(minCoord + start * latticeStep, minCoord + (start + size) * latticeStep);
+				};
+				if (excludesSurface(generationFunction(range(origin.x), range(origin.y), range(origin.z)))) return false;
+				mightCross = true;
+			}
+
+			// Sample a 3x3x3 grid over the node
+			float values[3][3][3];
+			bool anyInside = false, anyOutside = false;
+			for (int x = 0; x < 3; x++){
+				for (int y = 0; y < 3; y++){
+					for (int z = 0; z < 3; z++){
+						values[x][y][z] = latticeSample(origin + glm::ivec3(x, y, z) * (size / 2));
+						if (test(values[x][y][z])) anyInside = true;
+						else anyOutside = true;
+					}
+				}
+			}
+			// Without a crossing in the samples, only keep going if the bounds say the surface might still be there
+			if (!anyInside || !anyOutside) return mightCross;
+
+			// Largest difference between the samples and trilinear interpolation of the corners, turned into a distance
+			// by dividing by the slope of the function
+			float error = 0;
+			for (int x = 0; x < 3; x++){
+				for (int y = 0; y < 3; y++){
+					for (int z = 0; z < 3; z++){
+						float interpolated = 0;
+						for (int c = 0; c < 8; c++){
+							float weight = (cornerOffsets[c][0] ? x : 2 - x) * (cornerOffsets[c][1] ? y : 2 - y) * (cornerOffsets[c][2] ? z : 2 - z) / 8.0f;
+							interpolated += weight * values[cornerOffsets[c][0] * 2][cornerOffsets[c][1] * 2][cornerOffsets[c][2] * 2];
+						}
+						error = std::max(error, std::abs(values[x][y][z] - interpolated));
+					}
+				}
+			}
+			glm::vec3 slope(0.0f);
+			for (int c = 0; c < 8; c++){
+				float value = values[cornerOffsets[c][0] * 2][cornerOffsets[c][1] * 2][cornerOffsets[c][2] * 2];
+				for (int d = 0; d < 3; d++){
+					slope[d] += (cornerOffsets[c][d] ? value : -value) / (4 * size * latticeStep);
+				}
+			}
+			return error > adaptiveError * 2 * latticeStep * glm::length(slope);
+		}
+
+		void buildOctree(int level, int i, int j, int k){
+			if (shouldSplit(level, i, j, k)){
+				octree.split.insert(Octree::key(level, i, j, k));
+				for (int c = 0; c < 8; c++){
+					buildOctree(level + 1, i * 2 + cornerOffsets[c][0], j * 2 + cornerOffsets[c][1], k * 2 + cornerOffsets[c][2]);
+				}
+			}
+			else{
+				octree.leaves.insert(Octree::key(level, i, j, k));
+			}
+		}
+
+		// Splits leaves until no leaf touches (even at a corner) a leaf more than one level smaller than itself
+		void balanceOctree(){
+			std::vector<uint64_t> work(octree.leaves.begin(), octree.leaves.end());
+			while (!work.empty()){
+				uint64_t leaf = work.back();
+				work.pop_back();
+				if (octree.leaves.count(leaf) == 0) continue;	// Split since it was queued
+				int level = leaf >> 57, i = (leaf >> 38) & 0x7FFFF, j = (leaf >> 19) & 0x7FFFF, k = leaf & 0x7FFFF;
+				for (int n = 0; n < 27; n++){
+					int ni = i + n / 9 - 1, nj = j + n / 3 % 3 - 1, nk = k + n % 3 - 1;
+					if (n == 13 || !Octree::inside(level, ni, nj, nk)) continue;
+					int neighbourLevel = octree.leafLevel(level, ni, nj, nk);
+					if (neighbourLevel >= 0 && neighbourLevel < level - 1){
+						int shift = level - neighbourLevel;
+						octree.splitLeaf(neighbourLevel, ni >> shift, nj >> shift, nk >> shift);
+						for (int c = 0; c < 8; c++){
+							work.push_back(Octree::key(neighbourLevel + 1, (ni >> shift) * 2 + cornerOffsets[c][0], (nj >> shift) * 2 + cornerOffsets[c][1], (nk >> shift) * 2 + cornerOffsets[c][2]));
+						}
+						work.push_back(leaf);	// Check the other neighbours again once the split one has been refined enough
+						break;
+					}
+				}
+			}
+		}
+
+		// True if the edge of a node at the given level starting at start and running along axis is cut in half by a
+		// smaller cube touching it (i.e. one of the 4 nodes around it is split)
+		bool edgeSplit(int level, glm::ivec3 start, int axis) const{
+			int size = nodeSize(level);
+			int o1 = (axis + 1) % 3, o2 = (axis + 2) % 3;
+			for (int d1 = -1; d1 <= 0; d1++){
+				for (int d2 = -1; d2 <= 0; d2++){
+					glm::ivec3 node = start / size;
+					node[o1] += d1;
+					node[o2] += d2;
+					if (octree.isSplit(level, node.x, node.y, node.z)) return true;
+				}
+			}
+			return false;
+		}
+
+		// Adds the triangles (3 points each) that one face of a node at the given level is split into. The face is fanned
+		// from its centre, and if the node on the other side is split, each quarter of the face is fanned from its own
+		// centre instead. The cells on both sides of a face come up with the same triangles, so their tetrahedra
+		// (and the surface through them) meet without cracks.
+		void faceTriangles(int level, glm::ivec3 origin, int u, int w, bool subdivided, std::vector<glm::ivec3>& out) const{
+			int size = nodeSize(level);
+			glm::ivec3 eu(0), ew(0);
+			eu[u] = size;
+			ew[w] = size;
+			if (subdivided){
+				for (int q = 0; q < 4; q++){
+					faceTriangles(level + 1, origin + eu / 2 * (q % 2) + ew / 2 * (q / 2), u, w, false, out);
+				}
+				return;
+			}
+			glm::ivec3 corners[4] = {origin, origin + eu, origin + eu + ew, origin + ew};
+			glm::ivec3 centre = origin + eu / 2 + ew / 2;
+			for (int e = 0; e < 4; e++){
+				glm::ivec3 p = corners[e], q = corners[(e + 1) % 4];
+				if (edgeSplit(level, glm::min(p, q), e % 2 == 0 ? u : w)){
+					glm::ivec3 middle = (p + q) / 2;
+					out.insert(out.end(), {centre, p, middle, centre, middle, q});
+				}
+				else{
+					out.insert(out.end(), {centre, p, q});
+				}
+			}
+		}
+
+		glm::vec3 latticePosition(glm::ivec3 p) const{
+			return glm::vec3(minCoord) + glm::vec3(p) * latticeStep;
+		}
+
+		// Position of the vertex on the edge between two lattice points, where the linear interpolation of the samples at
+		// the ends crosses the iso value. The big cubes near flat parts of the surface would put vertices far off it if
+		// they were at edge midpoints. The ends are put in a fixed order so every cell using the edge gets the same point.
+		glm::vec3 edgeVertex(glm::ivec3 p, glm::ivec3 q){
+			if (latticeKey(q) < latticeKey(p)) std::swap(p, q);
+			float fp = latticeSample(p), fq = latticeSample(q);
+			float t = fp != fq ? glm::clamp((isoValue - fp) / (fq - fp), 0.0f, 1.0f) : 0.5f;
+			return latticePosition(p) + (latticePosition(q) - latticePosition(p)) * t;
+		}
+
+		// Adds one triangle with vertices on the given lattice edges, facing away from the inside point.
+		// With gradient normals, each new vertex's normal comes from functionGradient, since there's no grid of
+		// samples around it to take differences from; without a gradient() that costs 6 function calls per vertex.
+		void addEdgeTriangle(const glm::ivec3 (*edges)[2], glm::vec3 insidePoint, std::unordered_map<uint64_t, unsigned int>& edgeVertices){
+			// Work out the winding from the edge midpoints, since interpolated vertices can make a triangle with no area
+			glm::vec3 v[3], middles[3];
+			for (int i = 0; i < 3; i++){
+				v[i] = edgeVertex(edges[i][0], edges[i][1]);
+				middles[i] = (latticePosition(edges[i][0]) + latticePosition(edges[i][1])) * 0.5f;
+			}
+			int order[3] = {0, 1, 2};
+			if (glm::dot(glm::cross(middles[1] - middles[0], middles[2] - middles[0]), middles[0] - insidePoint) < 0){
+				std::swap(order[1], order[2]);
+			}
+			glm::vec3 normal = glm::cross(v[order[1]] - v[order[0]], v[order[2]] - v[order[0]]);
+			// Drop triangles whose vertices (nearly) coincide, since they have no normal to give
+			float minimumArea = 1e-6f * latticeStep * latticeStep;
+			if (glm::dot(normal, normal) <= minimumArea * minimumArea) return;
+
+			if (!indexed){
+				for (int i : order){
+					mesh.vertices.insert(mesh.vertices.end(), {v[i].x, v[i].y, v[i].z});
+					if (gradientNormals){
+						glm::vec3 gradient = vertexGradient(v[i]);
+						mesh.normalSums.insert(mesh.normalSums.end(), {gradient.x, gradient.y, gradient.z});
+					}
+				}
+				return;
+			}
+			for (int i : order){
+				// The sum of the edge's two end points is its midpoint on a twice as fine lattice, which identifies the edge
+				glm::ivec3 sum = edges[i][0] + edges[i][1];
+				uint64_t key = (uint64_t)sum.x << 38 | (uint64_t)sum.y << 19 | (uint64_t)sum.z;
+				auto found = edgeVertices.find(key);
+				unsigned int id;
+				if (found != edgeVertices.end()){
+					id = found->second;
+				}
+				else{
+					id = mesh.vertices.size() / 3;
+					edgeVertices.emplace(key, id);
+					mesh.vertices.insert(mesh.vertices.end(), {v[i].x, v[i].y, v[i].z});
+					if (gradientNormals){
+						glm::vec3 gradient = vertexGradient(v[i]);
+						mesh.normalSums.insert(mesh.normalSums.end(), {gradient.x, gradient.y, gradient.z});
+					}
+					else{
+						mesh.normalSums.insert(mesh.normalSums.end(), 3, 0.0f);
+					}
+				}
+				mesh.indices.emplace_back(id);
+				for (int d = 0; d < 3 && !gradientNormals; d++){
+					mesh.normalSums[id * 3 + d] += normal[d];
+				}
+			}
+		}
+
+		// Marching tetrahedra: adds the part of the surface inside one tetrahedron
+		void marchTetrahedron(const glm::ivec3* points, const bool* inside, std::unordered_map<uint64_t, unsigned int>& edgeVertices){
+			int in[4], out[4], inCount = 0, outCount = 0;
+			for (int i = 0; i < 4; i++){
+				if (inside[i]) in[inCount++] = i;
+				else out[outCount++] = i;
+			}
+			if (inCount == 0 || outCount == 0) return;
+			glm::vec3 insidePoint = latticePosition(points[in[0]]);
+			if (inCount == 1 || outCount == 1){
+				// One triangle around the corner that is on its own side
+				int lone = inCount == 1 ? in[0] : out[0];
+				const int* others = inCount == 1 ? out : in;
+				glm::ivec3 edges[3][2];
+				for (int i = 0; i < 3; i++){
+					edges[i][0] = points[lone];
+					edges[i][1] = points[others[i]];
+				}
+				addEdgeTriangle(edges, insidePoint, edgeVertices);
+			}
+			else{
+				// A quad through the 4 edges between the two inside and two outside corners
+				glm::ivec3 quad[4][2] = {
+					{points[in[0]], points[out[0]]}, {points[in[0]], points[out[1]]},
+					{points[in[1]], points[out[1]]}, {points[in[1]], points[out[0]]}
+				};
+				glm::ivec3 second[3][2] = {{quad[0][0], quad[0][1]}, {quad[2][0], quad[2][1]}, {quad[3][0], quad[3][1]}};
+				addEdgeTriangle(quad, insidePoint, edgeVertices);
+				addEdgeTriangle(second, insidePoint, edgeVertices);
+			}
+		}
+
+		// Splits a leaf into tetrahedra (its centre and each triangle of its faces) and marches them
+		void triangulateLeaf(int level, int i, int j, int k, std::vector<glm::ivec3>& triangles, std::unordered_map<uint64_t, unsigned int>& edgeVertices){
+			int size = nodeSize(level);
+			glm::ivec3 origin(i * size, j * size, k * size);
+			glm::ivec3 centre = origin + size / 2;
+			triangles.clear();
+			for (int d = 0; d < 3; d++){
+				for (int side = 0; side < 2; side++){
+					glm::ivec3 faceOrigin = origin;
+					faceOrigin[d] += side * size;
+					glm::ivec3 neighbour(i, j, k);
+					neighbour[d] += side ? 1 : -1;
+					faceTriangles(level, faceOrigin, (d + 1) % 3, (d + 2) % 3, octree.isSplit(level, neighbour.x, neighbour.y, neighbour.z), triangles);
+				}
+			}
+
+			// Skip leaves the surface doesn't pass through
+			bool centreInside = test(latticeSample(centre));
+			bool crossed = false;
+			for (glm::ivec3 p : triangles){
+				if (test(latticeSample(p)) != centreInside){
+					crossed = true;
+					break;
+				}
+			}
+			if (!crossed) return;
+
+			for (size_t t = 0; t < triangles.size(); t += 3){
+				glm::ivec3 points[4] = {centre, triangles[t], triangles[t + 1], triangles[t + 2]};
+				bool inside[4];
+				for (int p = 0; p < 4; p++) inside[p] = test(latticeSample(points[p]));
+				marchTetrahedron(points, inside, edgeVertices);
+			}
+		}
+
+		// Generates the entire mesh on an adaptive octree. The smallest cubes are no bigger than the step, but they are
+		// only used where the surface curves; flatter parts get bigger cubes.
+		void generateAdaptive(){
+			PROFILE_SCOPE(ProfileAdaptive);
+			maxLevel = 0;
+			while (maxLevel < Octree::MAX_LEVEL && (maxCoord - minCoord) / (1 << maxLevel) > stepSize * 1.0001f) maxLevel++;
+			// Without bounds, small pieces of surface can only be found by sampling, so start from fairly small cubes
+			minLevel = IsIntervalFunction<Function>::value ? std::min(2, maxLevel) : std::max(0, maxLevel - 3);
+			latticeStep = (maxCoord - minCoord) / (1 << (maxLevel + 1));
+
+			buildOctree(0, 0, 0, 0);
+			balanceOctree();
+
+			// Go through the leaves in a fixed order so the output doesn't depend on the hash tables
+			std::vector<uint64_t> leaves(octree.leaves.begin(), octree.leaves.end());
+			std::sort(leaves.begin(), leaves.end());
+			std::unordered_map<uint64_t, unsigned int> edgeVertices;
+			std::vector<glm::ivec3> triangles;
+			for (uint64_t leaf : leaves){
+				if (cancelled) break;
+				triangulateLeaf(leaf >> 57, (leaf >> 38) & 0x7FFFF, (leaf >> 19) & 0x7FFFF, leaf & 0x7FFFF, triangles, edgeVertices);
 			}
+			finished = true;
+			PROFILE_ITEMS(getTriangleCount());
 
-			currentIteration += stepSize;
-			if (currentIteration > maxCoord){
-				finished = true;
-				std::cout << "Done generating!" << std::endl;
-			} 
+			long long uniformCubes = 1LL << (3 * maxLevel);
+			printf("Adaptive octree: %zu leaves, smallest step %g; a uniform grid with that step has %lld cubes (%.2f%%)\n", leaves.size(), 2 * latticeStep, uniformCubes, 100.0 * leaves.size() / uniformCubes);
+			octree = Octree();
+			latticeSamples = std::unordered_map<uint64_t, float>();
 		}
 
-		// Compares a value to the iso value based on the selected comparator
-		bool test(float a){
-			switch (comparator){
+		// Compares a value to the iso value based on the selected comparator.
+		// With a fixed Comparison the switch is resolved at compile time.
+		bool test(float a) const{
+			switch (Comparison == RUNTIME_COMPARE ? comparator : (CompareOperation)Comparison){
 				case Less:
 					return a < isoValue;
 				case LessEqual:
@@ -223,112 +2630,113 @@ class MarchingCubes{
 			}
 		}
 
-		// Adds vertices to the vertices list based on the given list of indices and current coordinates
-		void add_triangles(int* verts, float x, float y, float z){
-			// First triangle
-			if (verts[0] >= 0){
-				// First vertex
-				vertices.emplace_back(x + stepSize * vertTable[verts[0]][0]);
-				vertices.emplace_back(y + stepSize * vertTable[verts[0]][1]);
-				vertices.emplace_back(z + stepSize * vertTable[verts[0]][2]);
-
-				// Second vertex
-				vertices.emplace_back(x + stepSize * vertTable[verts[1]][0]);
-				vertices.emplace_back(y + stepSize * vertTable[verts[1]][1]);
-				vertices.emplace_back(z + stepSize * vertTable[verts[1]][2]);
-
-				// Third vertex
-				vertices.emplace_back(x + stepSize * vertTable[verts[2]][0]);
-				vertices.emplace_back(y + stepSize * vertTable[verts[2]][1]);
-				vertices.emplace_back(z + stepSize * vertTable[verts[2]][2]);
-			}
-
-			// Second triangle
-			if (verts[3] >= 0){
-				// First vertex
-				vertices.emplace_back(x + stepSize * vertTable[verts[3]][0]);
-				vertices.emplace_back(y + stepSize * vertTable[verts[3]][1]);
-				vertices.emplace_back(z + stepSize * vertTable[verts[3]][2]);
-
-				// Second vertex
-				vertices.emplace_back(x + stepSize * vertTable[verts[4]][0]);
-				vertices.emplace_back(y + stepSize * vertTable[verts[4]][1]);
-				vertices.emplace_back(z + stepSize * vertTable[verts[4]][2]);
-
-				// Third vertex
-				vertices.emplace_back(x + stepSize * vertTable[verts[5]][0]);
-				vertices.emplace_back(y + stepSize * vertTable[verts[5]][1]);
-				vertices.emplace_back(z + stepSize * vertTable[verts[5]][2]);
-			}
-
-			// Third triangle
-			if (verts[6] >= 0){
-				// First vertex
-				vertices.emplace_back(x + stepSize * vertTable[verts[6]][0]);
-				vertices.emplace_back(y + stepSize * vertTable[verts[6]][1]);
-				vertices.emplace_back(z + stepSize * vertTable[verts[6]][2]);
-
-				// Second vertex
-				vertices.emplace_back(x + stepSize * vertTable[verts[7]][0]);
-				vertices.emplace_back(y + stepSize * vertTable[verts[7]][1]);
-				vertices.emplace_back(z + stepSize * vertTable[verts[7]][2]);
+		// True if bounds on the function over a box show the surface can't pass through it. The inside test is a threshold,
+		// so if both ends of the range give the same answer, so does everything between. The margin covers rounding
+		// differences between the bounds and the sampled values. Bounds that are NaN or not finite say nothing.
+		bool excludesSurface(Interval bounds) const{
+			if (!(bounds.lo <= bounds.hi) || !std::isfinite(bounds.lo) || !std::isfinite(bounds.hi)) return false;
+			float margin = 1e-5f * (1 + std::max(std::abs(bounds.lo), std::abs(bounds.hi)));
+			return test(bounds.lo - margin) == test(bounds.hi + margin);
+		}
 
-				// Third vertex
-				vertices.emplace_back(x + stepSize * vertTable[verts[8]][0]);
-				vertices.emplace_back(y + stepSize * vertTable[verts[8]][1]);
-				vertices.emplace_back(z + stepSize * vertTable[verts[8]][2]);
+		// Adds vertices to the given vertex list based on the given list of indices and current coordinates.
+		// edgePoints is the position of the vertex on each edge within the cube (vertTable, or see interpolateEdges).
+		// The loop runs for the case's triangle count with no tests on the table entries, writing straight into the list
+		// when it has room (a page), or else into a local array that is added in one go.
+		template <typename Vertices>
+		void add_triangles(const uint8_t* verts, int triangles, float x, float y, float z, const float (*edgePoints)[3], Vertices& out) const{
+			float staged[15 * 3];
+			float* vertices = appendSpace(out, triangles * 9);
+			bool inPlace = vertices != nullptr;
+			if (!inPlace) vertices = staged;
+			for (int i = 0; i < triangles * 3; i++){
+				const float* p = edgePoints[verts[i]];
+				vertices[i * 3] = x + stepSize * p[0];
+				vertices[i * 3 + 1] = y + stepSize * p[1];
+				vertices[i * 3 + 2] = z + stepSize * p[2];
 			}
+			if (inPlace) appendWritten(out, triangles * 9);
+			else appendValues(out, staged, triangles * 9);
+		}
 
-			// Fourth triangle
-			if (verts[9] >= 0){
-				// First vertex
-				vertices.emplace_back(x + stepSize * vertTable[verts[9]][0]);
-				vertices.emplace_back(y + stepSize * vertTable[verts[9]][1]);
-				vertices.emplace_back(z + stepSize * vertTable[verts[9]][2]);
-
-				// Second vertex
-				vertices.emplace_back(x + stepSize * vertTable[verts[10]][0]);
-				vertices.emplace_back(y + stepSize * vertTable[verts[10]][1]);
-				vertices.emplace_back(z + stepSize * vertTable[verts[10]][2]);
-
-				// Third vertex
-				vertices.emplace_back(x + stepSize * vertTable[verts[11]][0]);
-				vertices.emplace_back(y + stepSize * vertTable[verts[11]][1]);
-				vertices.emplace_back(z + stepSize * vertTable[verts[11]][2]);
+		// Identifies one of a cube's edges across the whole grid: its direction (0 = X, 1 = Y, 2 = Z) in the top bits,
+		// then the grid point it starts at with 20 bits per axis
+		static uint64_t edgeKey(const int* cube, int edge){
+			uint64_t key = 0;
+			for (int d = 0; d < 3; d++){
+				if (vertTable[edge][d] == 0.5f) key |= (uint64_t)d << 60;
+				key |= (uint64_t)(cube[d] + (vertTable[edge][d] == 1.0f ? 1 : 0)) << (40 - 20 * d);
 			}
+			return key;
+		}
 
-			// Fifth triangle
-			if (verts[12] >= 0){
-				// First vertex
-				vertices.emplace_back(x + stepSize * vertTable[verts[12]][0]);
-				vertices.emplace_back(y + stepSize * vertTable[verts[12]][1]);
-				vertices.emplace_back(z + stepSize * vertTable[verts[12]][2]);
-
-				// Second vertex
-				vertices.emplace_back(x + stepSize * vertTable[verts[13]][0]);
-				vertices.emplace_back(y + stepSize * vertTable[verts[13]][1]);
-				vertices.emplace_back(z + stepSize * vertTable[verts[13]][2]);
+		// Adds triangles to an indexed mesh, reusing the vertex already made on an edge by a neighbouring cube.
+		// cube is the cube's grid position and base is its position within the slice planes, and edgeTable/edgeSample
+		// locate each cube edge in the welding tables. edgePoints is as in add_triangles.
+		// With gradient normals, gradients has the cube's normal for each edge (see cubeGradients), which is added to the
+		// vertex once per cube; otherwise the face normals are added up.
+		// In Chunked mode the edge of each new vertex is also recorded.
+		template <typename Mesh>
+		void add_indexed_triangles(const uint8_t* verts, int triangles, const int* cube, const float (*edgePoints)[3], const float (*gradients)[3], int base, const int* edgeTable, const int* edgeSample, SliceEdges& edges, Mesh& out) const{
+			float x = grid.coord(cube[0]);
+			float y = grid.coord(cube[1]);
+			float z = grid.coord(cube[2]);
+			const float zero[3] = {0, 0, 0};
+			int added = 0;	// Edges whose gradient has been added to their vertex
+			for (int i = 0; i < triangles * 3; i += 3){
+				unsigned int ids[3];
+				for (int j = 0; j < 3; j++){
+					int edge = verts[i + j];
+					int& id = edges.tables[edgeTable[edge]][base + edgeSample[edge]];
+					if (id < 0){
+						id = out.vertices.size() / 3;
+						float position[3] = {x + stepSize * edgePoints[edge][0], y + stepSize * edgePoints[edge][1], z + stepSize * edgePoints[edge][2]};
+						appendValues(out.vertices, position, 3);
+						appendValues(out.normalSums, zero, 3);
+						if (generationMode == Chunked) out.edgeKeys.emplace_back(edgeKey(cube, edge));
+					}
+					ids[j] = id;
+					if (gradients != nullptr && !(added & (1 << edge))){
+						added |= 1 << edge;
+						for (int k = 0; k < 3; k++){
+							out.normalSums[id * 3 + k] += gradients[edge][k];
+						}
+					}
+				}
+				appendValues(out.indices, ids, 3);
+				if (gradients != nullptr) continue;
 
-				// Third vertex
-				vertices.emplace_back(x + stepSize * vertTable[verts[14]][0]);
-				vertices.emplace_back(y + stepSize * vertTable[verts[14]][1]);
-				vertices.emplace_back(z + stepSize * vertTable[verts[14]][2]);
+				// Add the face normal to all 3 vertices. The cross product's length is twice the triangle's area,
+				// so big triangles count for more in the vertex normals.
+				glm::vec3 v1(out.vertices[ids[0] * 3], out.vertices[ids[0] * 3 + 1], out.vertices[ids[0] * 3 + 2]);
+				glm::vec3 v2(out.vertices[ids[1] * 3], out.vertices[ids[1] * 3 + 1], out.vertices[ids[1] * 3 + 2]);
+				glm::vec3 v3(out.vertices[ids[2] * 3], out.vertices[ids[2] * 3 + 1], out.vertices[ids[2] * 3 + 2]);
+				glm::vec3 normal = glm::cross(v2 - v1, v3 - v1);
+				for (int j = 0; j < 3; j++){
+					out.normalSums[ids[j] * 3] += normal.x;
+					out.normalSums[ids[j] * 3 + 1] += normal.y;
+					out.normalSums[ids[j] * 3 + 2] += normal.z;
+				}
 			}
 		}
 	public:
-		bool finished = false;	// Becomes true when the mesh is finished generating (for incremental modes)
-		MarchingCubes(std::function<float(float, float, float)> f, float isoval, float min, float max, float step, CubesMode mode = Full, CompareOperation comp = Less){
+		std::atomic<bool> finished{false};	// Becomes true when the mesh is finished generating (for incremental modes)
+		// comp is ignored unless Comparison is RUNTIME_COMPARE
+		MarchingCubes(Function f, float isoval, float min, float max, float step, CubesMode mode = Full, CompareOperation comp = Less){
 			generationFunction = f;
 			isoValue = isoval;
 			minCoord = min;
 			maxCoord = max;
 			stepSize = step;
 			generationMode = mode;
-			comparator = comp;
-			currentIteration = minCoord;
+			comparator = Comparison == RUNTIME_COMPARE ? comp : (CompareOperation)Comparison;
+			grid = Grid(min, max, step);
 		}
 
 		void generate(){
+			auto startTime = std::chrono::steady_clock::now();
+			size_t firstVertex = getVertexCount();
+			size_t firstIndex = droppedIndices + mesh.indices.size();
 			switch (generationMode){
 				case Full:
 					generateFull();
@@ -340,20 +2748,335 @@ class MarchingCubes{
 				case Incremental_Z:
 					generateIterative();
 					break;
+				case Adaptive:
+					generateAdaptive();
+					break;
+				case Chunked:
+					generateBricks();
+					break;
+			}
+			if (finished && retainSamples && !cancelled && blockBounds.empty()){
+				computeBlockBounds();
+			}
+			revisions.emplace_back(getVertexCount(), droppedIndices + mesh.indices.size());
+			generationSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+			if (measureError){
+				measureMesh(firstVertex, firstIndex);
+			}
+			if (finished && !cancelled){
+				printf("Done generating! (%lld function evaluations, %.3f s, %.1f ns per cube)\n", stats.evaluations, generationSeconds, generationSeconds * 1e9 / grid.cubeCount());
+				if (stats.blocksTested > 0){
+					printf("Skipped %lld of %lld blocks (%.1f%%) that the surface can't pass through\n", stats.blocksSkipped, stats.blocksTested, 100.0 * stats.blocksSkipped / stats.blocksTested);
+				}
+				if (measureError){
+					printf("%lld triangles. Distance from the surface at vertices: mean %.6f, max %.6f; at triangle centres: mean %.6f, max %.6f\n",
+						getTriangleCount(), vertexError.mean(), vertexError.max, centreError.mean(), centreError.max);
+				}
+			}
+		}
+
+		// Gradient of the function at p: its own gradient() if it has one, otherwise central differences h either side
+		glm::vec3 functionGradient(glm::vec3 p, float h) const{
+			if constexpr (HasGradient<Function>::value){
+				return generationFunction.gradient(p.x, p.y, p.z);
+			}
+			else{
+				glm::vec3 gradient(
+					generationFunction(p.x + h, p.y, p.z) - generationFunction(p.x - h, p.y, p.z),
+					generationFunction(p.x, p.y + h, p.z) - generationFunction(p.x, p.y - h, p.z),
+					generationFunction(p.x, p.y, p.z + h) - generationFunction(p.x, p.y, p.z - h));
+				return gradient * (1.0f / (2 * h));
+			}
+		}
+
+		// Estimates the distance from a point to the surface as |f(p) - iso| / |gradient of f at p|.
+		// Without a gradient() the central differences are a small fraction of a step wide.
+		double surfaceDistance(glm::vec3 p) const{
+			float slope = glm::length(functionGradient(p, stepSize * 0.01f));
+			return slope > 0 ? std::abs(generationFunction(p.x, p.y, p.z) - isoValue) / slope : 0;
+		}
+
+		// Adds the distances from the surface of the vertices and triangles added since the given positions in the vertex
+		// and index lists to vertexError and centreError. Uses its own function calls, which aren't counted as
+		// evaluations or in the generation time.
+		void measureMesh(size_t firstVertex, size_t firstIndex){
+			ArrayView<float> vertices = getVertices(firstVertex);
+			for (size_t i = 0; i + 2 < vertices.size; i += 3){
+				vertexError.add(surfaceDistance(glm::vec3(vertices[i], vertices[i + 1], vertices[i + 2])));
+			}
+
+			// Triangles can use vertices from before firstVertex in indexed mode
+			auto vertex = [&](size_t v){
+				ArrayView<float> all = getVertices(v * 3);
+				return glm::vec3(all[0], all[1], all[2]);
+			};
+			if (indexed){
+				ArrayView<unsigned int> indices = getIndices(firstIndex);
+				for (size_t i = 0; i + 2 < indices.size; i += 3){
+					// Chunked mode has already dropped some of the seam vertices that the last triangles use
+					if ((size_t)std::min({indices[i], indices[i + 1], indices[i + 2]}) * 3 < droppedVertices) continue;
+					centreError.add(surfaceDistance((vertex(indices[i]) + vertex(indices[i + 1]) + vertex(indices[i + 2])) * (1.0f / 3)));
+				}
+			}
+			else{
+				for (size_t i = 0; i + 8 < vertices.size; i += 9){
+					glm::vec3 centre(vertices[i] + vertices[i + 3] + vertices[i + 6], vertices[i + 1] + vertices[i + 4] + vertices[i + 7], vertices[i + 2] + vertices[i + 5] + vertices[i + 8]);
+					centreError.add(surfaceDistance(centre * (1.0f / 3)));
+				}
+			}
+		}
+
+		// Makes the mesh again for a new iso value from the retained samples (see setRetainSamples), without calling the
+		// function. Only the cubes in blocks whose samples straddle the new iso value are classified and marched, and only
+		// the planes those blocks touch are classified. Replaces the whole mesh: the revisions start again, so
+		// getChanges(0) returns the new mesh.
+		void changeIsoValue(float iso){
+			auto startTime = std::chrono::steady_clock::now();
+			CubesMode axis = retainedAxis();
+			Region volume = wholeVolume();
+			int cells = grid.cells;
+			int blocks = blockCount(cells);
+			BlockLayers layers;
+			GenerationStats counters;
+			SliceEdges edges;
+			std::vector<bool> classified(grid.points(), false);
+			bool marchedPrevious = false;
+			isoValue = iso;
+			mesh = MeshData();
+			revisions.clear();
+			vertexError = SurfaceError();
+			centreError = SurfaceError();
+
+			for (int s = 0; s < cells; s++){
+				const uint8_t* active = activeBlocks(axis, volume, s / BLOCK_SIZE, layers, counters);
+				if (std::find(active, active + blocks * blocks, 1) == active + blocks * blocks){
+					marchedPrevious = false;
+					continue;
+				}
+				for (int p = s; p <= s + 1; p++){
+					if (!classified[p]) classify(retainedPlanes[p]);
+					classified[p] = true;
+				}
+				// Nothing was made on this slice's lower plane if the previous slice was skipped
+				if (!marchedPrevious) edges.reset(grid.points() * grid.points());
+				marchSlice(axis, volume, s, retainedPlanes[s], retainedPlanes[s + 1], active, mesh, edges);
+				edges.advance();
+				marchedPrevious = true;
+			}
+			revisions.emplace_back(getVertexCount(), mesh.indices.size());
+			if (measureError){
+				measureMesh(0, 0);
+			}
+
+			std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - startTime;
+			printf("Made the mesh for iso value %g in %.3f s: %lld triangles, marched %lld of %lld blocks\n",
+				iso, elapsed.count(), getTriangleCount(), counters.blocksTested - counters.blocksSkipped, counters.blocksTested);
+		}
+
+		// Turns on keeping every sample so changeIsoValue can be used once the mesh is finished. Only Full and incremental
+		// modes can keep them, and every point is sampled (no empty-space skipping). Must be called before generation starts.
+		void setRetainSamples(bool enable){
+			retainSamples = enable && generationMode != Adaptive && generationMode != Chunked;
+		}
+
+		// True once the mesh is finished with the samples retained, so changeIsoValue can be used
+		bool canChangeIsoValue() const{
+			return !blockBounds.empty();
+		}
+
+		// Returns the lowest and highest retained sample
+		Interval getSampleRange() const{
+			Interval range(INFINITY, -INFINITY);
+			for (const Interval& bounds : blockBounds){
+				range.lo = std::min(range.lo, bounds.lo);
+				range.hi = std::max(range.hi, bounds.hi);
+			}
+			return range;
+		}
+
+		float getIsoValue() const{
+			return isoValue;
+		}
+
+		// Times the table lookup and triangle emission step on its own: makes the triangles of each of the given cases
+		// (at the edge midpoints, not indexed) repeats times. Returns the nanoseconds per cube and the triangles made.
+		double timeEmission(const std::vector<uint8_t>& cases, int repeats, long long& triangles) const{
+			float edgePoints[12][3];
+			memcpy(edgePoints, vertTable, sizeof(edgePoints));
+			PagedArray<float> out;
+			triangles = 0;
+			auto startTime = std::chrono::steady_clock::now();
+			for (int r = 0; r < repeats; r++){
+				out.clear();
+				for (size_t i = 0; i < cases.size(); i++){
+					int cubeIndex = cases[i];
+					add_triangles(marching_cubes_lut[cubeIndex], triangleCounts[cubeIndex], grid.coord(i % grid.cells), 0, 0, edgePoints, out);
+				}
+				triangles += out.size() / 9;
+			}
+			std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - startTime;
+			return elapsed.count() * 1e9 / ((double)cases.size() * repeats);
+		}
+
+		// Sets the number of threads used in Full and Chunked modes. The generation function must be safe to call from
+		// several threads.
+		void setThreadCount(int threads){
+			threadCount = std::max(1, threads);
+		}
+
+		// Returns the number of slices generated so far and the total, for progress reports.
+		// Full and Adaptive modes count as a single slice, and Chunked mode counts bricks.
+		int getSlicesDone(){
+			return generationMode == Full || generationMode == Adaptive ? (finished ? 1 : 0) : (int)currentSlice;
+		}
+		int getSliceCount(){
+			if (generationMode == Chunked) return brickCount() * brickCount() * brickCount();
+			return generationMode == Full || generationMode == Adaptive ? 1 : grid.cells;
+		}
+
+		// Returns the number of cubes in the whole volume
+		long long getCubeCount(){
+			return grid.cubeCount();
+		}
+
+		// Returns how many times the generation function has been evaluated so far
+		long long getEvaluationCount(){
+			return stats.evaluations;
+		}
+
+		// Returns the time spent in generate() so far
+		double getGenerationSeconds() const{
+			return generationSeconds;
+		}
+
+		// Returns the cubes generated per second of generate() so far, counting finished slices (or bricks)
+		double getCubesPerSecond(){
+			if (generationSeconds <= 0) return 0;
+			return (double)getCubeCount() * getSlicesDone() / getSliceCount() / generationSeconds;
+		}
+
+		// Stops generation at the end of the current slice. Safe to call while another thread is in generate().
+		void cancel(){
+			cancelled = true;
+		}
+
+		// Sets how far (in smallest steps) the mesh may be from the surface before Adaptive mode uses smaller cubes
+		void setAdaptiveError(float error){
+			adaptiveError = error;
+		}
+
+		// Sets the number of cubes along each side of the bricks in Chunked mode (rounded up to a multiple of 8).
+		// Must be called before generation starts.
+		void setBrickSize(int cubes){
+			brickSize = std::max(1, (cubes + BLOCK_SIZE - 1) / BLOCK_SIZE) * BLOCK_SIZE;
+		}
+
+		// Turns on vertex welding and the index list. Must be called before generation starts.
+		void setIndexed(bool enable){
+			indexed = enable;
+		}
+
+		bool isIndexed() const{
+			return indexed;
+		}
+
+		// Turns on making the vertex normals from the function's gradient while generating, instead of from the
+		// triangles afterwards. Must be called before generation starts.
+		void setGradientNormals(bool enable){
+			gradientNormals = enable;
+		}
+
+		// True if getNormals has the normals (indexed or gradient normals); otherwise use generateNormals on the vertices
+		bool hasNormals() const{
+			return indexed || gradientNormals;
+		}
+
+		// Turns on interpolating vertices along the cube edges (always done in Adaptive mode). Must be called before generation starts.
+		void setInterpolation(bool enable){
+			interpolate = enable;
+		}
+
+		// Turns on measuring the distance from the vertices to the surface, printed when generation finishes
+		void setMeasureError(bool enable){
+			measureError = enable;
+		}
+
+		// Returns the number of triangles generated so far
+		long long getTriangleCount() const{
+			return indexed ? (droppedIndices + mesh.indices.size()) / 3 : getVertexCount() / 9;
+		}
+
+		// Returns a view of the vertices list from the given float onwards, without copying it.
+		// Chunked mode only keeps what the last call to generate() added, so the view starts there at the earliest.
+		ArrayView<float> getVertices(size_t first = 0) const{
+			return ArrayView<float>(mesh.vertices, std::max(first, droppedVertices) - droppedVertices);
+		}
+
+		// Returns a view of the triangle indices (indexed mode) from the given index onwards
+		ArrayView<unsigned int> getIndices(size_t first = 0) const{
+			return ArrayView<unsigned int>(mesh.indices, std::max(first, droppedIndices) - droppedIndices);
+		}
+
+		// Number of times generate() has been called. Revision 0 is the empty mesh.
+		size_t getRevision() const{
+			return revisions.size();
+		}
+
+		// Returns views of everything added to the mesh since the given revision
+		MeshDelta getChanges(size_t revision) const{
+			MeshDelta delta;
+			if (revision > 0 && revision <= revisions.size()){
+				delta.firstVertex = revisions[revision - 1].first;
+				delta.firstIndex = revisions[revision - 1].second;
+			}
+			delta.vertices = getVertices(delta.firstVertex);
+			delta.indices = getIndices(delta.firstIndex);
+
+			// New triangles in indexed mode change the normals of the old vertices they use, except in Chunked mode
+			// where vertices are only handed out once their normals are final
+			delta.changedNormals = delta.firstVertex;
+			delta.finalNormals = getVertexCount();
+			if (indexed && generationMode != Chunked){
+				for (unsigned int index : delta.indices){
+					delta.changedNormals = std::min(delta.changedNormals, (size_t)index * 3);
+				}
+				if (!finished) delta.finalNormals = delta.changedNormals;
+			}
+			return delta;
+		}
+
+		// Writes the smooth vertex normals (indexed or gradient normals) for the floats in [first, last) to out.
+		// A vertex's normal can still change until the slice after the one that made it is generated.
+		void getNormals(size_t first, size_t last, std::vector<float>& out) const{
+			PROFILE_SCOPE(ProfileNormals);
+			first = std::max(first, droppedVertices) - droppedVertices;
+			last = std::min(std::max(last, droppedVertices) - droppedVertices, mesh.normalSums.size());
+			PROFILE_ITEMS(last > first ? (last - first) / 3 : 0);
+			out.clear();
+			for (size_t i = first; i + 2 < last; i += 3){
+				glm::vec3 normal(mesh.normalSums[i], mesh.normalSums[i + 1], mesh.normalSums[i + 2]);
+				float length = glm::length(normal);
+				if (length > 0) normal = normal * (1.0f / length);
+				out.emplace_back(normal.x);
+				out.emplace_back(normal.y);
+				out.emplace_back(normal.z);
 			}
 		}
 
-		// Returns the vertices list for populating buffers
-		std::vector<float> getVertices(){
-			return vertices;
+		// Returns the number of floats in the vertices list, including any dropped by Chunked mode
+		size_t getVertexCount() const{
+			return droppedVertices + mesh.vertices.size();
 		}
 };
 
-// Generates a list of normals for a list of vertices
-std::vector<float> generateNormals(std::vector<float> vertices){
-	std::vector<float> normals;
-	int size = vertices.size();
-	if (size < 9) return normals;
+// Generates flat normals for a list of triangle vertices (every 3 vertices form a triangle) into out
+void generateNormals(ArrayView<float> vertices, std::vector<float>& out){
+	PROFILE_SCOPE(ProfileNormals);
+	PROFILE_ITEMS(vertices.size / 3);
+	out.clear();
+	int size = vertices.size;
+	if (size < 9) return;
+	out.reserve(size);
 	for (int i = 8; i < size; i += 9){
 		// Putting the iterator at the end of a vertex means it won't break if, for some reason,
 		// the last vertex in the list is incomplete.
@@ -369,143 +3092,577 @@ std::vector<float> generateNormals(std::vector<float> vertices){
 
 		// Add the normal to the list 3 times
 		for (int j = 0; j < 3; j++){
-			normals.emplace_back(normal.x);
-			normals.emplace_back(normal.y);
-			normals.emplace_back(normal.z);
+			out.emplace_back(normal.x);
+			out.emplace_back(normal.y);
+			out.emplace_back(normal.z);
+		}
+	}
+}
+
+// A piece of the mesh finished by the generation thread, ready to be uploaded.
+// In indexed mode, the new triangles can use vertices from earlier chunks, which changes those vertices' normals.
+// normals holds every normal from normalStart (a float index) onwards and replaces the old ones from that point.
+struct MeshChunk{
+	std::vector<float> vertices;
+	std::vector<unsigned int> indices;
+	std::vector<float> normals;
+	size_t normalStart = 0;
+	double cubesPerSecond = 0;	// Generation speed so far, for the window title
+	bool replace = false;		// The mesh was made again for a new iso value; replaces everything sent before
+	float isoValue = 0;
+};
+
+// Lock-free queue for passing items from exactly one producer thread to exactly one consumer thread.
+// Each index is only written by one side, so the acquire/release pairs are the only synchronization needed.
+template <typename T, size_t Capacity>
+class SPSCQueue{
+	T items[Capacity];
+	std::atomic<size_t> head{0};	// Next item to pop (written by the consumer)
+	std::atomic<size_t> tail{0};	// Next free slot (written by the producer)
+public:
+	// Returns false without moving from the item if the queue is full
+	bool push(T& item){
+		size_t t = tail.load(std::memory_order_relaxed);
+		if (t - head.load(std::memory_order_acquire) == Capacity) return false;
+		items[t % Capacity] = std::move(item);
+		tail.store(t + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Returns false if the queue is empty
+	bool pop(T& item){
+		size_t h = head.load(std::memory_order_relaxed);
+		if (h == tail.load(std::memory_order_acquire)) return false;
+		item = std::move(items[h % Capacity]);
+		head.store(h + 1, std::memory_order_release);
+		return true;
+	}
+};
+
+// OpenGL buffer that grows by doubling its size, so new data can be added with glBufferSubData
+// instead of uploading everything again. The buffer keeps the same name when it grows, so VAOs using it stay valid.
+class GrowableBuffer{
+	GLuint buffer = 0;
+	GLenum target = GL_ARRAY_BUFFER;
+	size_t capacity = 0;	// Allocated bytes
+	size_t size = 0;		// Bytes in use
+
+	// Reallocates the buffer with room for at least the given number of bytes, keeping the contents
+	void reserve(size_t bytes){
+		size_t newCapacity = std::max(capacity * 2, (size_t)(1 << 16));
+		while (newCapacity < bytes) newCapacity *= 2;
+
+		// Keep the old contents in a temporary buffer while the buffer is reallocated (copied on the GPU)
+		GLuint temp = 0;
+		if (size > 0){
+			glGenBuffers(1, &temp);
+			glBindBuffer(GL_COPY_WRITE_BUFFER, temp);
+			glBufferData(GL_COPY_WRITE_BUFFER, size, NULL, GL_STREAM_COPY);
+			glBindBuffer(GL_COPY_READ_BUFFER, buffer);
+			glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, size);
+		}
+		glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+		glBufferData(GL_COPY_WRITE_BUFFER, newCapacity, NULL, GL_DYNAMIC_DRAW);
+		if (temp != 0){
+			glBindBuffer(GL_COPY_READ_BUFFER, temp);
+			glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, size);
+			glDeleteBuffers(1, &temp);
+		}
+		capacity = newCapacity;
+	}
+
+public:
+	// Creates the buffer and binds it to the given target (e.g. while a VAO is bound)
+	void create(GLenum bufferTarget){
+		target = bufferTarget;
+		glGenBuffers(1, &buffer);
+		glBindBuffer(target, buffer);
+	}
+
+	// Replaces the contents from the given byte offset onwards with data. Offset must not be past the end.
+	void update(size_t offset, const void* data, size_t bytes){
+		if (offset + bytes > capacity){
+			reserve(offset + bytes);
+		}
+		if (bytes > 0){
+			glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+			glBufferSubData(GL_COPY_WRITE_BUFFER, offset, bytes, data);
+		}
+		size = offset + bytes;
+	}
+
+	// Adds data to the end of the buffer
+	void append(const void* data, size_t bytes){
+		update(size, data, bytes);
+	}
+
+	size_t getSize(){
+		return size;
+	}
+};
+
+// Uniform buffer binding point for the Frame block in the shaders
+const GLuint FRAME_BINDING = 0;
+
+// Compiles and links a shader program, and connects its Frame uniform block to FRAME_BINDING
+GLuint createProgram(const char* vertexSource, const char* fragmentSource){
+	GLuint vertexShaderID = glCreateShader(GL_VERTEX_SHADER);
+	GLuint fragmentShaderID = glCreateShader(GL_FRAGMENT_SHADER);
+	glShaderSource(vertexShaderID, 1, &vertexSource, NULL);
+	glCompileShader(vertexShaderID);
+	glShaderSource(fragmentShaderID, 1, &fragmentSource, NULL);
+	glCompileShader(fragmentShaderID);
+	GLuint program = glCreateProgram();
+	glAttachShader(program, vertexShaderID);
+	glAttachShader(program, fragmentShaderID);
+	glLinkProgram(program);
+	glDetachShader(program, vertexShaderID);
+	glDetachShader(program, fragmentShaderID);
+	glDeleteShader(vertexShaderID);
+	glDeleteShader(fragmentShaderID);
+	glUniformBlockBinding(program, glGetUniformBlockIndex(program, "Frame"), FRAME_BINDING);
+	return program;
+}
+
+// Per-frame shader data, laid out like the Frame uniform block in the shaders (std140)
+struct FrameUniforms{
+	glm::mat4 mvp;
+	glm::mat4 view;
+};
+
+// Uniform buffer for the Frame block, shared by every program. It is allocated once and updated in place every frame.
+class FrameUniformBuffer{
+	GLuint buffer = 0;
+
+public:
+	void create(){
+		glGenBuffers(1, &buffer);
+		glBindBuffer(GL_UNIFORM_BUFFER, buffer);
+		glBufferData(GL_UNIFORM_BUFFER, sizeof(FrameUniforms), NULL, GL_DYNAMIC_DRAW);
+		glBindBufferBase(GL_UNIFORM_BUFFER, FRAME_BINDING, buffer);
+	}
+
+	// Uploads this frame's matrices
+	void update(const glm::mat4& mvp, const glm::mat4& view){
+		FrameUniforms frame = {mvp, view};
+		glBindBuffer(GL_UNIFORM_BUFFER, buffer);
+		glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(FrameUniforms), &frame);
+	}
+};
+
+// Shader program for the mesh. The uniform locations are looked up once when the program is linked, and the
+// uniforms that never change are set then too. The per-frame matrices come from the FrameUniformBuffer.
+class MeshShader{
+	GLuint program = 0;
+	GLint colorLocation = -1;
+	GLint lightDirLocation = -1;
+
+public:
+	// Compiles and links the shaders and sets up the uniforms. Needs a current OpenGL context.
+	void create(){
+		program = createProgram(vertexShader, fragmentShader);
+		colorLocation = glGetUniformLocation(program, "modelColor");
+		lightDirLocation = glGetUniformLocation(program, "lightDir");
+		glUseProgram(program);
+		glUniform4fv(colorLocation, 1, MODEL_COLOR);
+		glUniform3fv(lightDirLocation, 1, LIGHT_DIRECTION);
+		glUseProgram(0);
+	}
+
+	void use(){
+		glUseProgram(program);
+	}
+};
+
+// Coloured lines that never change, kept in a VBO and drawn with the line shader in one call
+class LineSet{
+	GLuint vao = 0;
+	GLuint vbo = 0;
+	GLsizei count = 0;	// Number of line ends
+
+public:
+	// vertices holds x, y, z, r, g, b for each end of each line
+	void create(const std::vector<GLfloat>& vertices){
+		count = vertices.size() / 6;
+		glGenVertexArrays(1, &vao);
+		glBindVertexArray(vao);
+		glGenBuffers(1, &vbo);
+		glBindBuffer(GL_ARRAY_BUFFER, vbo);
+		glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(GLfloat), vertices.data(), GL_STATIC_DRAW);
+		glEnableVertexAttribArray(0);
+		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(GLfloat), (void*)0);
+		glEnableVertexAttribArray(1);
+		glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(GLfloat), (void*)(3 * sizeof(GLfloat)));
+		glBindVertexArray(0);
+	}
+
+	void draw() const{
+		glBindVertexArray(vao);
+		glDrawArrays(GL_LINES, 0, count);
+		glBindVertexArray(0);
+	}
+};
+
+class Axes {
+
+	glm::vec3 origin;
+	glm::vec3 extents;
+
+	glm::vec3 xcol = glm::vec3(1.0f, 0.0f, 0.0f);
+	glm::vec3 ycol = glm::vec3(0.0f, 1.0f, 0.0f);
+	glm::vec3 zcol = glm::vec3(0.0f, 0.0f, 1.0f);
+
+	LineSet lines;
+	bool wideLines = true;	// Forward compatible contexts only have 1 pixel lines
+
+	static void addLine(std::vector<GLfloat>& out, glm::vec3 a, glm::vec3 b, glm::vec3 col){
+		out.insert(out.end(), {a.x, a.y, a.z, col.x, col.y, col.z, b.x, b.y, b.z, col.x, col.y, col.z});
+	}
+
+public:
+
+	Axes(glm::vec3 orig, glm::vec3 ex) : origin(orig), extents(ex) {}
+
+	// Puts the lines in a VBO. Needs a current OpenGL context.
+	void create() {
+		std::vector<GLfloat> v;
+		glm::vec3 xend = origin + glm::vec3(extents.x, 0, 0);
+		addLine(v, origin, xend, xcol);
+		addLine(v, xend, xend + glm::vec3(0, 0, 0.1), xcol);
+		addLine(v, xend, xend - glm::vec3(0, 0, 0.1), xcol);
+
+		glm::vec3 yend = origin + glm::vec3(0, extents.y, 0);
+		addLine(v, origin, yend, ycol);
+		addLine(v, yend, yend + glm::vec3(0, 0, 0.1), ycol);
+		addLine(v, yend, yend - glm::vec3(0, 0, 0.1), ycol);
+
+		glm::vec3 zend = origin + glm::vec3(0, 0, extents.z);
+		addLine(v, origin, zend, zcol);
+		addLine(v, zend, zend + glm::vec3(0.1, 0, 0), zcol);
+		addLine(v, zend, zend - glm::vec3(0.1, 0, 0), zcol);
+		lines.create(v);
+
+		GLint flags = 0;
+		glGetIntegerv(GL_CONTEXT_FLAGS, &flags);
+		wideLines = !(flags & GL_CONTEXT_FLAG_FORWARD_COMPATIBLE_BIT);
+	}
+
+	// Draws the axes (with the line shader in use)
+	void draw() {
+		if (wideLines) glLineWidth(2.0f);
+		lines.draw();
+		if (wideLines) glLineWidth(1.0f);
+	}
+
+};
+
+// Lines along the 12 edges of the box from (min, min, min) to (max, max, max), in white
+std::vector<GLfloat> boxLines(float min, float max){
+	std::vector<GLfloat> out;
+	for (int axis = 0; axis < 3; axis++){
+		// 4 edges run along each axis, one from each corner of the face at the low end
+		for (int corner = 0; corner < 4; corner++){
+			glm::vec3 a(min), b;
+			a[(axis + 1) % 3] = corner & 1 ? max : min;
+			a[(axis + 2) % 3] = corner & 2 ? max : min;
+			b = a;
+			b[axis] = max;
+			out.insert(out.end(), {a.x, a.y, a.z, 1.0f, 1.0f, 1.0f, b.x, b.y, b.z, 1.0f, 1.0f, 1.0f});
+		}
+	}
+	return out;
+}
+
+// Output format for PLY files
+enum PLYFormat{
+	ASCII,
+	BinaryLittleEndian
+};
+
+// Writes a PLY file through a large output buffer instead of one stream write (and flush) per line.
+// Vertices and triangles can be added bit by bit while the mesh is still being generated:
+// the element counts in the header are left as fixed-width placeholders and filled in by close(),
+// and triangles are spooled to a temporary file because PLY stores them after all the vertices.
+// Without indices, every 3 vertices form a triangle and the faces are written by close().
+class PLYWriter{
+	static const size_t BUFFER_SIZE = 1 << 20;
+	FILE* file = NULL;
+	FILE* faceSpool = NULL;
+	std::vector<char> buffer;
+	PLYFormat format = ASCII;
+	bool indexed = false;
+	long vertexCountPos = 0;
+	long faceCountPos = 0;
+	size_t vertexCount = 0;
+	size_t faceCount = 0;
+	size_t bytesWritten = 0;	// Bytes written to the file and the face spool, counting spooled faces twice
+	double writeSeconds = 0;	// Time spent in the writer, not counting time between calls while streaming
+
+	void flush(FILE* target){
+		if (!buffer.empty()){
+			fwrite(buffer.data(), 1, buffer.size(), target);
+			bytesWritten += buffer.size();
+			buffer.clear();
+		}
+	}
+
+	void put(const char* data, size_t size, FILE* target){
+		if (buffer.size() + size > BUFFER_SIZE) flush(target);
+		buffer.insert(buffer.end(), data, data + size);
+	}
+
+	// Writes a 32 bit value in little-endian byte order no matter what the host uses
+	void putLE(uint32_t value, FILE* target){
+		char bytes[4] = {(char)(value & 0xFF), (char)((value >> 8) & 0xFF), (char)((value >> 16) & 0xFF), (char)((value >> 24) & 0xFF)};
+		put(bytes, 4, target);
+	}
+
+	void putLE(float value, FILE* target){
+		uint32_t bits;
+		memcpy(&bits, &value, 4);
+		putLE(bits, target);
+	}
+
+	// Writes a number as text followed by the separator
+	template <typename T>
+	void putText(T value, char separator, FILE* target){
+		char text[32];
+		char* end = std::to_chars(text, text + sizeof(text) - 1, value).ptr;
+		*end++ = separator;
+		put(text, end - text, target);
+	}
+
+	void writeTriangle(uint32_t i1, uint32_t i2, uint32_t i3, FILE* target){
+		if (format == ASCII){
+			put("3 ", 2, target);
+			putText(i1, ' ', target);
+			putText(i2, ' ', target);
+			putText(i3, '\n', target);
+		}
+		else{
+			char count = 3;
+			put(&count, 1, target);
+			putLE(i1, target);
+			putLE(i2, target);
+			putLE(i3, target);
+		}
+		faceCount++;
+	}
+
+public:
+	~PLYWriter(){
+		close();
+	}
+
+	// Creates the file and writes the header. Returns false if the file can't be created.
+	bool open(std::string filename, PLYFormat plyFormat, bool indexedMesh){
+		format = plyFormat;
+		indexed = indexedMesh;
+		file = fopen(filename.c_str(), format == ASCII ? "w" : "wb");
+		if (file == NULL){
+			return false;
+		}
+		if (indexed){
+			faceSpool = tmpfile();
+			if (faceSpool == NULL){
+				fclose(file);
+				file = NULL;
+				return false;
+			}
+		}
+		buffer.reserve(BUFFER_SIZE);
+
+		fputs("ply\n", file);
+		fputs(format == ASCII ? "format ascii 1.0\n" : "format binary_little_endian 1.0\n", file);
+		fputs("element vertex ", file);
+		vertexCountPos = ftell(file);
+		fputs("0000000000\n", file);
+		fputs("property float x\nproperty float y\nproperty float z\n", file);
+		fputs("property float nx\nproperty float ny\nproperty float nz\n", file);
+		fputs("element face ", file);
+		faceCountPos = ftell(file);
+		fputs("0000000000\n", file);
+		fputs("property list uchar uint vertex_indices\n", file);
+		fputs("end_header\n", file);
+		return true;
+	}
+
+	bool isOpen(){
+		return file != NULL;
+	}
+
+	// Appends count vertices with their normals (3 floats each)
+	void addVertices(const float* vertices, const float* normals, size_t count){
+		PROFILE_SCOPE(ProfileWrite);
+		PROFILE_ITEMS(-(long long)bytesWritten);
+		auto startTime = std::chrono::steady_clock::now();
+		for (size_t i = 0; i < count * 3; i += 3){
+			if (format == ASCII){
+				putText(vertices[i], ' ', file);
+				putText(vertices[i + 1], ' ', file);
+				putText(vertices[i + 2], ' ', file);
+				putText(normals[i], ' ', file);
+				putText(normals[i + 1], ' ', file);
+				putText(normals[i + 2], '\n', file);
+			}
+			else{
+				for (int j = 0; j < 3; j++) putLE(vertices[i + j], file);
+				for (int j = 0; j < 3; j++) putLE(normals[i + j], file);
+			}
+		}
+		vertexCount += count;
+		writeSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+		PROFILE_ITEMS(bytesWritten);
+	}
+
+	// Appends triangles of an indexed mesh (3 vertex numbers each)
+	void addTriangles(const unsigned int* indices, size_t count){
+		if (count == 0) return;
+		PROFILE_SCOPE(ProfileWrite);
+		PROFILE_ITEMS(-(long long)bytesWritten);
+		auto startTime = std::chrono::steady_clock::now();
+		// The vertex buffer goes out first, so that it doesn't get mixed up with face data for the spool
+		flush(file);
+		for (size_t i = 0; i < count * 3; i += 3){
+			writeTriangle(indices[i], indices[i + 1], indices[i + 2], faceSpool);
+		}
+		flush(faceSpool);
+		writeSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+		PROFILE_ITEMS(bytesWritten);
+	}
+
+	// Writes the faces, fills in the element counts and closes the file
+	void close(){
+		if (file == NULL) return;
+		PROFILE_SCOPE(ProfileWrite);
+		PROFILE_ITEMS(-(long long)bytesWritten);
+		auto startTime = std::chrono::steady_clock::now();
+
+		flush(file);
+		if (indexed){
+			// Copy the spooled faces after the vertices
+			std::vector<char> copyBuffer(BUFFER_SIZE);
+			size_t read;
+			rewind(faceSpool);
+			while ((read = fread(copyBuffer.data(), 1, copyBuffer.size(), faceSpool)) > 0){
+				bytesWritten += fwrite(copyBuffer.data(), 1, read, file);
+			}
+			fclose(faceSpool);
+			faceSpool = NULL;
+		}
+		else{
+			for (uint32_t i = 0; i + 2 < vertexCount; i += 3){
+				writeTriangle(i, i + 1, i + 2, file);
+			}
+			flush(file);
 		}
+		double fileMegabytes = ftell(file) / 1e6;
+
+		char count[12];
+		snprintf(count, sizeof(count), "%010zu", vertexCount);
+		fseek(file, vertexCountPos, SEEK_SET);
+		fwrite(count, 1, 10, file);
+		snprintf(count, sizeof(count), "%010zu", faceCount);
+		fseek(file, faceCountPos, SEEK_SET);
+		fwrite(count, 1, 10, file);
+		fclose(file);
+		file = NULL;
+
+		writeSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+		PROFILE_ITEMS(bytesWritten);
+		double megabytes = bytesWritten / 1e6;
+		printf("Finished writing file! (%zu vertices, %zu faces, %.1f MB file, %.1f MB written in %.3f s, %.1f MB/s)\n",
+			vertexCount, faceCount, fileMegabytes, megabytes, writeSeconds, megabytes / writeSeconds);
 	}
-	return normals;
-}
 
-class Axes {
+	// Time spent writing so far
+	double getWriteSeconds() const{
+		return writeSeconds;
+	}
 
-	glm::vec3 origin;
-	glm::vec3 extents;
+	// Bytes written so far, including copying spooled faces to the file
+	size_t getBytesWritten() const{
+		return bytesWritten;
+	}
+};
 
-	glm::vec3 xcol = glm::vec3(1.0f, 0.0f, 0.0f);
-	glm::vec3 ycol = glm::vec3(0.0f, 1.0f, 0.0f);
-	glm::vec3 zcol = glm::vec3(0.0f, 0.0f, 1.0f);
+// Writes a mesh to a PLY file while it is generated (--stream). After each generate() call, add() writes the new
+// triangles, and in indexed mode every vertex whose normal can't change any more.
+class MeshStreamer{
+	PLYWriter writer;
+	size_t streamed = 0;	// Floats of the vertex list already written to the file
+	std::vector<float> normals;
 
 public:
+	bool open(std::string filename, PLYFormat format, bool indexed){
+		return writer.open(filename, format, indexed);
+	}
 
-	Axes(glm::vec3 orig, glm::vec3 ex) : origin(orig), extents(ex) {}
+	bool isOpen(){
+		return writer.isOpen();
+	}
 
-	void draw() {
+	// Writes the changes from the last generate() call. deltaNormals are the normals of delta's vertices,
+	// which are only used without indexing.
+	template <typename Cubes>
+	void add(const Cubes& cubes, const MeshDelta& delta, const std::vector<float>& deltaNormals){
+		if (cubes.isIndexed()){
+			// Vertices before finalNormals won't be used by any later triangles, so their normals are final
+			size_t final = delta.finalNormals;
+			if (final > streamed){
+				cubes.getNormals(streamed, final, normals);
+				writer.addVertices(cubes.getVertices(streamed).data, normals.data(), (final - streamed) / 3);
+				streamed = final;
+			}
+			writer.addTriangles(delta.indices.data, delta.indices.size / 3);
+		}
+		else{
+			writer.addVertices(delta.vertices.data, deltaNormals.data(), delta.vertices.size / 3);
+		}
+	}
 
-		glMatrixMode( GL_MODELVIEW );
-		glPushMatrix();
-
-
-		glLineWidth(2.0f);
-		glBegin(GL_LINES);
-		glColor3f(xcol.x, xcol.y, xcol.z);
-		glVertex3f(origin.x, origin.y, origin.z);
-		glVertex3f(origin.x + extents.x, origin.y, origin.z);
-
-		glVertex3f(origin.x + extents.x, origin.y, origin.z);
-		glVertex3f(origin.x + extents.x, origin.y, origin.z+0.1);
-		glVertex3f(origin.x + extents.x, origin.y, origin.z);
-		glVertex3f(origin.x + extents.x, origin.y, origin.z-0.1);
-
-		glColor3f(ycol.x, ycol.y, ycol.z);
-		glVertex3f(origin.x, origin.y, origin.z);
-		glVertex3f(origin.x, origin.y + extents.y, origin.z);
-
-		glVertex3f(origin.x, origin.y + extents.y, origin.z);
-		glVertex3f(origin.x, origin.y + extents.y, origin.z+0.1);
-		glVertex3f(origin.x, origin.y + extents.y, origin.z);
-		glVertex3f(origin.x, origin.y + extents.y, origin.z-0.1);
-		
-		glColor3f(zcol.x, zcol.y, zcol.z);
-		glVertex3f(origin.x, origin.y, origin.z);
-		glVertex3f(origin.x, origin.y, origin.z + extents.z);
-		
-		glVertex3f(origin.x, origin.y, origin.z + extents.z);
-		glVertex3f(origin.x+0.1, origin.y, origin.z + extents.z);
-
-		glVertex3f(origin.x, origin.y, origin.z + extents.z);
-		glVertex3f(origin.x-0.1, origin.y, origin.z + extents.z);
-		glEnd();
-
-
-		//glPopMatrix();
-	}
-
-};
-
-void draw_box(float min, float max){
-	glColor3f(1.0f, 1.0f, 1.0f);
-	glBegin(GL_LINE_STRIP);
-		glVertex3f(min, min, min);
-		glVertex3f(max, min, min);
-		glVertex3f(max, max, min);
-		glVertex3f(min, max, min);
-		glVertex3f(min, min, min);
-		glVertex3f(min, min, max);
-		glVertex3f(max, min, max);
-		glVertex3f(max, max, max);
-		glVertex3f(min, max, max);
-		glVertex3f(min, min, max);
-	glEnd();
-	glBegin(GL_LINES);
-		glVertex3f(min, max, min);
-		glVertex3f(min, max, max);
-		glVertex3f(max, max, min);
-		glVertex3f(max, max, max);
-		glVertex3f(max, min, min);
-		glVertex3f(max, min, max);
-	glEnd();
-}
-
-void writePLY(std::string filename, std::vector<float> vertices, std::vector<float> normals){
-	// Create file
-	std::ofstream file(filename);
-	if (file.fail()){
-		printf("Error creating file\n");
-		return;
-	}
-
-	int numVertices = vertices.size() / 3;
-	int numFaces = numVertices / 3;
-
-	// Write header
-	file << "ply" << std::endl;
-	file << "format ascii 1.0" << std::endl;
-	file << "element vertex " << numVertices << std::endl;
-	file << "property float x" << std::endl;
-	file << "property float y" << std::endl;
-	file << "property float z" << std::endl;
-	file << "property float nx" << std::endl;
-	file << "property float ny" << std::endl;
-	file << "property float nz" << std::endl;
-	file << "element face " << numFaces << std::endl;
-	file << "property list uchar uint vertex_indices" << std::endl;
-	file << "end_header" << std::endl;
-
-	// Write vertices
-	int total = vertices.size() / 10000;
-	for (int i = 2; i < vertices.size(); i += 3){
-		file << vertices[i - 2] << " " << vertices[i - 1] << " " << vertices[i] << " " << normals[i - 2] << " " << normals[i - 1] << " " << normals[i] << std::endl;
-		if (i % 10000 == 0)
-			std::cout << "Writing vertices: " << i / 10000 << " / " << total << std::endl;
-	}
-
-	// Write faces
-	total = numVertices / 10000;
-	for (int i = 2; i < numVertices; i+= 3){
-		file << "3 " << i - 2 << " " << i - 1 << " " << i << std::endl;
-		if (i % 10000 == 0)
-			std::cout << "Writing faces: " << i / 10000 << " / " << total << std::endl;
-	}
-
-	printf("Finished writing file!\n");
-	file.close();
-}
+	void close(){
+		writer.close();
+	}
 
-int main(int argc, char* argv[]){
+	double getWriteSeconds() const{
+		return writer.getWriteSeconds();
+	}
+
+	size_t getBytesWritten() const{
+		return writer.getBytesWritten();
+	}
+};
+
+// Writes a finished mesh to a PLY file in one go and returns the time it took, and the bytes written in bytesWritten if
+// it's given. Normals are worked out a block at a time, so the whole mesh is never copied.
+template <typename Cubes>
+double writePLY(std::string filename, const Cubes& cubes, PLYFormat format, size_t* bytesWritten = nullptr){
+	const size_t BLOCK_SIZE = 3 * 3 * 65536;	// Floats per block (a whole number of triangles)
+	PLYWriter writer;
+	if (!writer.open(filename, format, cubes.isIndexed())){
+		printf("Error creating file\n");
+		return 0;
+	}
 	std::vector<float> normals;
+	ArrayView<float> vertices = cubes.getVertices();
+	for (size_t first = 0; first < vertices.size; first += BLOCK_SIZE){
+		ArrayView<float> block(vertices.data + first, std::min(BLOCK_SIZE, vertices.size - first));
+		if (cubes.hasNormals())
+			cubes.getNormals(first, first + block.size, normals);
+		else
+			generateNormals(block, normals);
+		writer.addVertices(block.data, normals.data(), block.size / 3);
+	}
+	ArrayView<unsigned int> indices = cubes.getIndices();
+	writer.addTriangles(indices.data, indices.size / 3);
+	writer.close();
+	if (bytesWritten != nullptr) *bytesWritten = writer.getBytesWritten();
+	return writer.getWriteSeconds();
+}
 
-	// Todo: Command line args for step size, min, max, iso
+// Settings from the command line
+struct Options{
 	float step = DEFAULT_STEP;
 	float min = DEFAULT_MIN;
 	float max = DEFAULT_MAX;
@@ -513,74 +3670,234 @@ int main(int argc, char* argv[]){
 	CubesMode mode = Incremental_Z;
 	std::string filename = "test.ply";
 	bool generateFile = true;
+	int threads = std::max(1u, std::thread::hardware_concurrency());
+	bool indexed = false;
+	PLYFormat plyFormat = ASCII;
+	bool streamFile = false;
+	bool generic = false;	// Use MarchingCubes<> (function and comparator picked at run time) instead of the compiled-in ones
+	std::string function = "f";	// f, or one of the built-in functions: sphere, wave, tube
+	std::string expression;		// Expression to compile and generate instead (--expression)
+	std::string volume;			// Voxel volume file to generate from instead (--volume)
+	std::string volumeSize;		// NXxNYxNZ, for volume files without a header
+	std::string voxelType;		// float or uint16, for volume files without a header
+	float adaptiveError = 0.5f;	// Allowed error in Adaptive mode, in smallest steps
+	int brickSize = 64;			// Cubes along each side of a brick in Chunked mode
+	bool interpolate = false;	// Interpolate vertices along the cube edges instead of using the midpoints
+	bool measureError = false;	// Print how far the vertices are from the surface
+	bool gradientNormals = false;	// Make the vertex normals from the function's gradient instead of the triangles
+	bool batch = false;			// Generate and write the file without opening a window
+	bool retain = false;		// Keep the samples so the iso value can be changed in the window
+	bool benchmark = false;		// Run the benchmark suite and write the results to the file instead
+	std::string traceFile;		// Where to write the Chrome trace (builds with -DPROFILE only)
+};
 
-	try{
-		if (argc > 1){
-			filename = argv[1];
-		}
-		else{
-			generateFile = false;
-		}
-		if (argc > 2){
-			min = std::stof(argv[2]);
-			max = std::stof(argv[3]);
-		}
-		if (argc > 4){
-			step = std::stof(argv[4]);
-		}
-		if (argc > 5){
-			isoval = std::stof(argv[5]);
-		}
-		if (argc > 6){
-			if (strcmp(argv[6], "f") == 0){
-				mode = Full;
-			}
-			else if (strcmp(argv[6], "x") == 0){
-				mode = Incremental_X;
-			}
-			else if (strcmp(argv[6], "y") == 0){
-				mode = Incremental_Y;
-			}
-			else if (strcmp(argv[6], "z") == 0){
-				mode = Incremental_Z;
-			}
-			else{
-				printf("Mode must be one of: f, x, y, z\n");
-				return -1;
-			}
+// Passes the generation settings to the MarchingCubes object
+template <typename Cubes>
+void setupCubes(Cubes& cubes, const Options& options){
+	cubes.setThreadCount(options.threads);
+	cubes.setIndexed(options.indexed);
+	cubes.setAdaptiveError(options.adaptiveError);
+	cubes.setBrickSize(options.brickSize);
+	cubes.setInterpolation(options.interpolate);
+	cubes.setMeasureError(options.measureError);
+	cubes.setGradientNormals(options.gradientNormals);
+	cubes.setRetainSamples(options.retain);
+}
+
+// Calls generate() until the mesh is finished, writing each part to the stream if it's open
+template <typename Cubes>
+void generateAll(Cubes& cubes, MeshStreamer& stream){
+	size_t revision = 0;
+	std::vector<float> normals;
+	while (!cubes.finished){
+		cubes.generate();
+		if (!stream.isOpen()) continue;
+		MeshDelta delta = cubes.getChanges(revision);
+		revision = cubes.getRevision();
+		// In indexed mode the streamer gets the normals itself
+		if (!cubes.isIndexed()){
+			if (cubes.hasNormals())
+				cubes.getNormals(delta.firstVertex, cubes.getVertexCount(), normals);
+			else
+				generateNormals(delta.vertices, normals);
 		}
+		stream.add(cubes, delta, normals);
 	}
-	catch (...){
-		printf("Usage: as5 filename min max step iso mode\n");
-		printf("min, max, step, iso must be numbers\n");
+}
+
+// Generates the mesh and writes the file without a window (--batch), then prints how long it all took.
+// GLFW and GLEW are never initialized, so this works without a display.
+template <typename Cubes>
+int runBatch(Cubes& cubes, const Options& options){
+	auto startTime = std::chrono::steady_clock::now();
+	setupCubes(cubes, options);
+	MeshStreamer stream;
+	if (options.generateFile && options.streamFile && !stream.open(options.filename, options.plyFormat, options.indexed)){
+		printf("Error creating file\n");
 		return -1;
 	}
-	if (max <= min){
-		printf("Max must be greater than min\n");
-		std::cout << max << " " << min;
-		return -1;
+
+	generateAll(cubes, stream);
+
+	double writeSeconds = 0;
+	if (stream.isOpen()){
+		stream.close();
+		writeSeconds = stream.getWriteSeconds();
 	}
-	if (step <= 0){
-		printf("Step must be positive\n");
-		return -1;
+	else if (options.generateFile){
+		writeSeconds = writePLY(options.filename, cubes, options.plyFormat);
 	}
-	if (!generateFile){
-		printf("No filename specified. No PLY file will be generated.\n");
+	double totalSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+	printf("Batch finished in %.3f s: %.3f s generating, %.3f s writing the file, %lld triangles, %lld function evaluations\n",
+		totalSeconds, totalSeconds - writeSeconds, writeSeconds, cubes.getTriangleCount(), cubes.getEvaluationCount());
+	return 0;
+}
+
+// Starts measuring peak memory use (peakMemory) from now. Only works on Linux.
+void resetPeakMemory(){
+#ifdef __linux__
+	malloc_trim(0);	// Give freed memory back first, or it still counts as in use
+	FILE* file = fopen("/proc/self/clear_refs", "w");
+	if (file != NULL){
+		fputs("5", file);
+		fclose(file);
+	}
+#endif
+}
+
+// Returns the most memory the process has had in use (resident) since resetPeakMemory, in bytes, or 0 if it's unknown
+size_t peakMemory(){
+	size_t bytes = 0;
+#ifdef __linux__
+	FILE* file = fopen("/proc/self/status", "r");
+	if (file == NULL) return 0;
+	char line[256];
+	while (fgets(line, sizeof(line), file) != NULL){
+		unsigned long kilobytes;
+		if (sscanf(line, "VmHWM: %lu kB", &kilobytes) == 1){
+			bytes = kilobytes * 1024;
+			break;
+		}
 	}
+	fclose(file);
+#endif
+	return bytes;
+}
 
-	float slowness = (max - min) / step;
-	if (slowness > 300 && mode == Full){
-		printf("Warning: You picked Full mode with a very small step size and/or large mesh dimensions. Mesh generation will be slow and the program will be unresponsive for a while.\n");
+// Functions, volumes, steps and modes covered by --benchmark. Every combination is run.
+struct BenchmarkFunction{
+	const char* name;
+	float isoval;
+};
+const BenchmarkFunction BENCHMARK_FUNCTIONS[] = {{"sphere", 1.0f}, {"wave", 0.5f}, {"tube", 0.5f}};
+const float BENCHMARK_SIZES[] = {2.0f, 4.0f};	// The volume goes from -size to size on each axis
+const float BENCHMARK_STEPS[] = {0.04f, 0.02f, 0.01f};
+const CubesMode BENCHMARK_MODES[] = {Full, Incremental_Z, Adaptive, Chunked};
+const char MODE_NAMES[] = "fxyzac";	// Command line names of the modes, in CubesMode order
+
+// Runs one benchmark case and writes its line of results. The PLY file is written to plyName (in Chunked mode as
+// it's generated, otherwise at the end) and deleted afterwards.
+template <typename Function>
+void benchmarkCase(Function function, const char* name, float isoval, float size, float step, CubesMode mode, const Options& options, const std::string& plyName, FILE* results){
+	resetPeakMemory();
+	MarchingCubes<Function, Less> cubes(function, isoval, -size, size, step, mode);
+	setupCubes(cubes, options);
+	MeshStreamer stream;
+	if (mode == Chunked) stream.open(plyName, options.plyFormat, options.indexed);
+	generateAll(cubes, stream);
+	double writeSeconds;
+	size_t bytesWritten = 0;
+	if (stream.isOpen()){
+		stream.close();
+		writeSeconds = stream.getWriteSeconds();
+		bytesWritten = stream.getBytesWritten();
 	}
+	else{
+		writeSeconds = writePLY(plyName, cubes, options.plyFormat, &bytesWritten);
+	}
+	double memoryMB = peakMemory() / 1e6;
+
+	double fileMB = 0;
+	std::ifstream file(plyName, std::ios::binary | std::ios::ate);
+	if (file) fileMB = file.tellg() / 1e6;
+	file.close();
+	std::remove(plyName.c_str());
+
+	double seconds = cubes.getGenerationSeconds();
+	fprintf(results, "%s,%g,%g,%c,%d,%d,%lld,%lld,%lld,%.6f,%.6g,%.6g,%.6g,%.1f,%.3f,%.6f,%.1f\n",
+		name, size * 2, step, MODE_NAMES[mode], options.threads, options.indexed ? 1 : 0,
+		cubes.getCubeCount(), cubes.getTriangleCount(), cubes.getEvaluationCount(), seconds,
+		cubes.getCubeCount() / seconds, cubes.getTriangleCount() / seconds, cubes.getEvaluationCount() / seconds,
+		memoryMB, fileMB, writeSeconds, writeSeconds > 0 ? bytesWritten / 1e6 / writeSeconds : 0.0);
+	fflush(results);
+}
 
+// Microbenchmark of marchSlice's table lookup and triangle emission step, printed before the benchmark runs.
+// Goes through every case with triangles equally often, in a fixed random order so branches can't be predicted.
+// There are few enough cubes for the triangles to stay in the cache, so it times the emission rather than memory.
+void benchmarkEmission(){
+	std::vector<uint8_t> cases(8 * 254);
+	uint32_t random = 12345;
+	for (size_t i = 0; i < cases.size(); i++){
+		cases[i] = 1 + i % 254;
+	}
+	for (size_t i = cases.size() - 1; i > 0; i--){
+		random = random * 1664525 + 1013904223;
+		std::swap(cases[i], cases[random % (i + 1)]);
+	}
+	MarchingCubes<SphereFunction, Less> cubes(SphereFunction(), 1, -2, 2, 0.01f);
+	long long triangles = 0;
+	double nanoseconds = cubes.timeEmission(cases, 4000, triangles);
+	printf("Lookup and emission: %.2f ns per cube, %.2f ns per triangle\n", nanoseconds, nanoseconds * cases.size() * 4000 / triangles);
+}
 
+// Runs every benchmark case (--benchmark) and writes the results to a CSV file, one line per case.
+// The other options (threads, indexing, interpolation, file format...) apply to every case.
+int runBenchmark(const Options& options){
+	benchmarkEmission();
+	std::string resultsName = options.generateFile ? options.filename : "benchmark.csv";
+	FILE* results = fopen(resultsName.c_str(), "w");
+	if (results == NULL){
+		printf("Error creating file\n");
+		return -1;
+	}
+	fputs("function,size,step,mode,threads,indexed,cubes,triangles,evaluations,generate_s,cubes_per_s,triangles_per_s,evaluations_per_s,peak_memory_mb,ply_mb,write_s,write_mb_per_s\n", results);
+	std::string plyName = resultsName + ".tmp.ply";
+	for (const BenchmarkFunction& function : BENCHMARK_FUNCTIONS){
+		for (float size : BENCHMARK_SIZES){
+			for (float step : BENCHMARK_STEPS){
+				for (CubesMode mode : BENCHMARK_MODES){
+					printf("Benchmark: %s, size %g, step %g, mode %c\n", function.name, size * 2, step, MODE_NAMES[mode]);
+					if (strcmp(function.name, "sphere") == 0)
+						benchmarkCase(SphereFunction(), function.name, function.isoval, size, step, mode, options, plyName, results);
+					else if (strcmp(function.name, "wave") == 0)
+						benchmarkCase(WaveFunction(), function.name, function.isoval, size, step, mode, options, plyName, results);
+					else
+						benchmarkCase(TubeFunction(), function.name, function.isoval, size, step, mode, options, plyName, results);
+				}
+			}
+		}
+	}
+	fclose(results);
+	printf("Benchmark results written to %s\n", resultsName.c_str());
+	return 0;
+}
 
+// Opens the window and shows the mesh while it is generated, then writes the file if one was given
+template <typename Cubes>
+int showMesh(Cubes& cubes, Options options){
 	// Initialize window
 	if (!glfwInit()){
 		printf("Failed to initialize GLFW\n");
 		return -1;
 	}
 	glfwWindowHint(GLFW_SAMPLES, 4);
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+#ifdef __APPLE__
+	glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);	// macOS only has forward compatible core contexts
+#endif
 	window = glfwCreateWindow(1000, 1000, "Assignment 5", NULL, NULL);
 	if (window == NULL){
 		printf("Failed to open window\n");
@@ -596,6 +3913,7 @@ int main(int argc, char* argv[]){
 		glfwTerminate();
 		return -1;
 	}
+	glGetError();	// GLEW asks for the extension string the old way, which is an error in core profile contexts
 
 	glClearColor(0, 0, 0, 1);
 	glEnable(GL_DEPTH_TEST);
@@ -611,18 +3929,20 @@ int main(int argc, char* argv[]){
 	glm::mat4 model = glm::mat4(1.0f);
 	mvp = projection * view * model;
 
-	MarchingCubes cubes(f, isoval, min, max, step, mode);
-	Axes ax(glm::vec3(min), glm::vec3(max - min));
+	setupCubes(cubes, options);
+	Axes ax(glm::vec3(options.min), glm::vec3(options.max - options.min));
+	ax.create();
+	LineSet box;
+	box.create(boxLines(options.min, options.max));
 
 
 	// Set up the VAO and buffers
-	GLuint vao, vertexVBO, normalVBO, programID;
+	GLuint vao;
+	GrowableBuffer vertexVBO, normalVBO, indexEBO;
 	glGenVertexArrays(1, &vao);
 	glBindVertexArray(vao);
 	// Vertex VBO
-	glGenBuffers(1, &vertexVBO);
-	glBindBuffer(GL_ARRAY_BUFFER, vertexVBO);
-	glBufferData(GL_ARRAY_BUFFER, 0, &cubes.getVertices()[0], GL_DYNAMIC_DRAW);
+	vertexVBO.create(GL_ARRAY_BUFFER);
 	glEnableVertexAttribArray(0);
 	glVertexAttribPointer(
 		0,
@@ -633,9 +3953,7 @@ int main(int argc, char* argv[]){
 		(void*)0
 	);
 	// Normal VBO
-	glGenBuffers(1, &normalVBO);
-	glBindBuffer(GL_ARRAY_BUFFER, normalVBO);
-	glBufferData(GL_ARRAY_BUFFER, 0, &normals, GL_DYNAMIC_DRAW);
+	normalVBO.create(GL_ARRAY_BUFFER);
 	glEnableVertexAttribArray(1);
 	glVertexAttribPointer(
 		1,
@@ -645,23 +3963,16 @@ int main(int argc, char* argv[]){
 		0,
 		(void*)0
 	);
+	// Index buffer (only used in indexed mode)
+	indexEBO.create(GL_ELEMENT_ARRAY_BUFFER);
 	glBindVertexArray(0);
 
 	// Shaders
-	GLuint vertexShaderID = glCreateShader(GL_VERTEX_SHADER);
-	GLuint fragmentShaderID = glCreateShader(GL_FRAGMENT_SHADER);
-	glShaderSource(vertexShaderID, 1, &vertexShader, NULL);
-	glCompileShader(vertexShaderID);
-	glShaderSource(fragmentShaderID, 1, &fragmentShader, NULL);
-	glCompileShader(fragmentShaderID);
-	programID = glCreateProgram();
-	glAttachShader(programID, vertexShaderID);
-	glAttachShader(programID, fragmentShaderID);
-	glLinkProgram(programID);
-	glDetachShader(programID, vertexShaderID);
-	glDetachShader(programID, fragmentShaderID);
-	glDeleteShader(vertexShaderID);
-	glDeleteShader(fragmentShaderID);
+	MeshShader shader;
+	shader.create();
+	GLuint lineProgram = createProgram(lineVertexShader, lineFragmentShader);
+	FrameUniformBuffer frameUniforms;
+	frameUniforms.create();
 
 	glClear(GL_COLOR_BUFFER_BIT);
 	glfwSwapBuffers(window);	// Swap buffers once so the screen is at least black instead of glitchy during Full mesh generation
@@ -680,6 +3991,83 @@ int main(int argc, char* argv[]){
 	double prevTime = glfwGetTime();
 	bool wroteFile = false;
 
+	// Generate the mesh on its own thread so the window stays responsive.
+	// Each generate() call (one slice, or the whole mesh in Full mode) is sent to this thread as a chunk.
+	SPSCQueue<MeshChunk, 64> chunkQueue;
+	std::atomic<bool> generationDone{false};
+	std::atomic<bool> stopGeneration{false};
+	// With --retain, the render thread asks for a new iso value here once isoStep (a mouse wheel notch) is set
+	std::atomic<float> requestedIso{options.isoval};
+	std::atomic<float> isoStep{0};
+	if (options.retain){
+		glfwSetScrollCallback(window, scrollCallback);
+	}
+	// With --stream, the generation thread also writes each chunk to the file as soon as it's made
+	MeshStreamer plyStream;
+	if (options.generateFile && options.streamFile && !plyStream.open(options.filename, options.plyFormat, options.indexed)){
+		printf("Error creating file\n");
+		options.generateFile = false;
+	}
+	std::thread generationThread([&](){
+		size_t revision = 0;
+		// Copies only what was added since the last chunk and sends it to the render thread. The chunk owns its data
+		// because the generation thread keeps changing the mesh while the render thread uploads it.
+		auto sendChanges = [&](bool replace){
+			MeshDelta delta = cubes.getChanges(revision);
+			revision = cubes.getRevision();
+			MeshChunk newChunk;
+			newChunk.cubesPerSecond = cubes.getCubesPerSecond();
+			newChunk.replace = replace;
+			newChunk.isoValue = cubes.getIsoValue();
+			newChunk.vertices.assign(delta.vertices.begin(), delta.vertices.end());
+			newChunk.indices.assign(delta.indices.begin(), delta.indices.end());
+			if (cubes.hasNormals()){
+				// Resend normals from the oldest vertex used by the new triangles
+				newChunk.normalStart = delta.changedNormals;
+				cubes.getNormals(newChunk.normalStart, cubes.getVertexCount(), newChunk.normals);
+			}
+			else{
+				newChunk.normalStart = delta.firstVertex;
+				generateNormals(delta.vertices, newChunk.normals);
+			}
+
+			if (plyStream.isOpen()){
+				plyStream.add(cubes, delta, newChunk.normals);
+			}
+
+			// Wait for the render thread to catch up if the queue is full
+			while (!chunkQueue.push(newChunk) && !stopGeneration){
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			}
+		};
+		while (!cubes.finished && !stopGeneration){
+			cubes.generate();
+			sendChanges(false);
+		}
+		plyStream.close();
+
+		// With --retain, make the mesh again from the samples whenever the iso value is changed, until the window is closed.
+		// Requests that come in while a mesh is being made are merged into the latest one.
+		if (options.retain && cubes.canChangeIsoValue()){
+			Interval range = cubes.getSampleRange();
+			isoStep = std::max(range.hi - range.lo, 1e-6f) / ISO_STEPS;
+			printf("Change the iso value with the mouse wheel or + and - (samples range from %g to %g)\n", range.lo, range.hi);
+		}
+		float iso = options.isoval;
+		while (isoStep > 0 && !stopGeneration){
+			if (requestedIso == iso){
+				std::this_thread::sleep_for(std::chrono::milliseconds(5));
+				continue;
+			}
+			iso = requestedIso;
+			cubes.changeIsoValue(iso);
+			revision = 0;
+			sendChanges(true);
+		}
+		generationDone = true;
+	});
+	float iso = options.isoval;
+
 	while (!glfwWindowShouldClose(window)){
 		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
@@ -705,61 +4093,76 @@ int main(int argc, char* argv[]){
 			// Zoom out (no limit)
 			r += ZOOM_SPEED * deltaTime;
 		}
+		// Change the iso value with the mouse wheel or + and - (--retain)
+		if (isoStep > 0){
+			float notches = scrollOffset;
+			if (glfwGetKey(window, GLFW_KEY_EQUAL) == GLFW_PRESS || glfwGetKey(window, GLFW_KEY_KP_ADD) == GLFW_PRESS){
+				notches += ISO_KEY_SPEED * deltaTime;
+			}
+			if (glfwGetKey(window, GLFW_KEY_MINUS) == GLFW_PRESS || glfwGetKey(window, GLFW_KEY_KP_SUBTRACT) == GLFW_PRESS){
+				notches -= ISO_KEY_SPEED * deltaTime;
+			}
+			if (notches != 0){
+				iso += notches * isoStep;
+				requestedIso = iso;
+			}
+		}
+		scrollOffset = 0;
 
 		eyePos = {r * cos(glm::radians(theta)) * sin(glm::radians(phi)), r * cos(glm::radians(phi)), r * sin(glm::radians(theta)) * sin(glm::radians(phi))};
 		view = glm::lookAt(eyePos, zero, up);
 		mvp = projection * view * model;
 
-		// Generate more of the mesh if it's not done yet (also update vertex and normal buffers)
-		if (!cubes.finished){
-			cubes.generate();
-			std::vector<float> vertices = cubes.getVertices();
-			normals = generateNormals(vertices);
-
-			// Update buffers
-			glBindVertexArray(vao);
-			glBindBuffer(GL_ARRAY_BUFFER, normalVBO);
-			glBufferData(GL_ARRAY_BUFFER, normals.size() * sizeof(GL_FLOAT), &normals[0], GL_DYNAMIC_DRAW);
-			glBindBuffer(GL_ARRAY_BUFFER, vertexVBO);
-			glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(GL_FLOAT), &vertices[0], GL_DYNAMIC_DRAW);
-			glBindVertexArray(0);
-		}
-		else if (!wroteFile && generateFile){
-			// Mesh is done - generate file if enabled
-			std::vector<float> vertices = cubes.getVertices();
-			normals = generateNormals(vertices);
-			writePLY(filename, vertices, normals);
+		// Upload any chunks the generation thread has finished since the last frame.
+		// Only the new data is uploaded, plus the normals that changed in indexed mode.
+		MeshChunk chunk;
+		bool receivedChunk = false;
+		while (chunkQueue.pop(chunk)){
+			PROFILE_SCOPE(ProfileUpload);
+			PROFILE_ITEMS((chunk.vertices.size() + chunk.normals.size()) * sizeof(GLfloat) + chunk.indices.size() * sizeof(GLuint));
+			// A new mesh for another iso value overwrites the buffers from the start
+			vertexVBO.update(chunk.replace ? 0 : vertexVBO.getSize(), chunk.vertices.data(), chunk.vertices.size() * sizeof(GLfloat));
+			indexEBO.update(chunk.replace ? 0 : indexEBO.getSize(), chunk.indices.data(), chunk.indices.size() * sizeof(GLuint));
+			normalVBO.update(chunk.normalStart * sizeof(GLfloat), chunk.normals.data(), chunk.normals.size() * sizeof(GLfloat));
+			receivedChunk = true;
+		}
+		if (receivedChunk){
+			// Show progress in the window title
+			std::string title = "Assignment 5";
+			if (!cubes.finished){
+				char speed[64];
+				snprintf(speed, sizeof(speed), " (%.1f million cubes/s)", chunk.cubesPerSecond / 1e6);
+				title += " - Generating slice " + std::to_string(cubes.getSlicesDone()) + " / " + std::to_string(cubes.getSliceCount()) + speed;
+			}
+			else if (options.retain){
+				char isoText[64];
+				snprintf(isoText, sizeof(isoText), " - iso value %g", chunk.isoValue);
+				title += isoText;
+			}
+			glfwSetWindowTitle(window, title.c_str());
+		}
+		else if (generationDone && !wroteFile && options.generateFile && !options.streamFile){
+			// Mesh is done and every chunk has been received - generate file if enabled.
+			// The generation thread has stopped changing the mesh, so it can be read directly.
+			writePLY(options.filename, cubes, options.plyFormat);
 			wroteFile = true;
 		}
 
+		frameUniforms.update(mvp, view);
+
 		// Draw the axes and box
-		glMatrixMode(GL_PROJECTION);
-		glPushMatrix();
-		glLoadMatrixf(glm::value_ptr(projection));
-		glMatrixMode(GL_MODELVIEW);
-		glPushMatrix();
-		glLoadMatrixf(glm::value_ptr(view));
+		glUseProgram(lineProgram);
 		ax.draw();
-		draw_box(min, max);
+		box.draw();
 
 		// Draw the mesh
-		glUseProgram(programID);
-
-		// Set up uniforms		
-		GLuint matrixID = glGetUniformLocation(programID, "MVP");		
-		glUniformMatrix4fv(matrixID, 1, GL_FALSE, &mvp[0][0]);
-
-		GLuint viewID = glGetUniformLocation(programID, "V");
-		glUniformMatrix4fv(viewID, 1, GL_FALSE, &view[0][0]);
-
-		GLuint colorID = glGetUniformLocation(programID, "modelColor");
-		glUniform4fv(colorID, 1, MODEL_COLOR);
-
-		GLuint lightDirID = glGetUniformLocation(programID, "lightDir");
-		glUniform3fv(lightDirID, 1, LIGHT_DIRECTION);
+		shader.use();
 
 		glBindVertexArray(vao);
-		glDrawArrays(GL_TRIANGLES, 0, normals.size());
+		if (cubes.isIndexed())
+			glDrawElements(GL_TRIANGLES, indexEBO.getSize() / sizeof(GLuint), GL_UNSIGNED_INT, (void*)0);
+		else
+			glDrawArrays(GL_TRIANGLES, 0, vertexVBO.getSize() / (3 * sizeof(GLfloat)));
 		glBindVertexArray(0);
 		glUseProgram(0);
 
@@ -770,5 +4173,321 @@ int main(int argc, char* argv[]){
 		glfwSwapBuffers(window);
 	}
 
+	// Stop the generation thread if the window was closed before the mesh was finished
+	stopGeneration = true;
+	cubes.cancel();
+	generationThread.join();
+
+	// With --retain the mesh can change until the window is closed, so the file has the last one
+	if (options.retain && options.generateFile && cubes.canChangeIsoValue()){
+		writePLY(options.filename, cubes, options.plyFormat);
+	}
+
 	return 0;
-}
\ No newline at end of file
+}
+// Generates and shows the mesh of the given function
+template <typename Function>
+int run(Function function, const Options& options){
+	if (options.generic){
+		MarchingCubes<> cubes(function, options.isoval, options.min, options.max, options.step, options.mode, Less);
+		return options.batch ? runBatch(cubes, options) : showMesh(cubes, options);
+	}
+	MarchingCubes<Function, Less> cubes(function, options.isoval, options.min, options.max, options.step, options.mode);
+	return options.batch ? runBatch(cubes, options) : showMesh(cubes, options);
+}
+
+// Maps the volume file given with --volume and works out its size and voxel type from its header, or from
+// --volume-size and --voxel-type (which override the header). Prints what's wrong and returns false if it can't be used.
+bool openVolume(const Options& options, MappedFile& file, VolumeInfo& info){
+	if (!file.open(options.volume)){
+		printf("Error opening volume file %s\n", options.volume.c_str());
+		return false;
+	}
+	bool header = readVolumeHeader(file, info);
+	if (!options.volumeSize.empty()){
+		if (sscanf(options.volumeSize.c_str(), "%dx%dx%d", &info.size[0], &info.size[1], &info.size[2]) != 3){
+			printf("Volume size must be given as NXxNYxNZ, e.g. 256x256x128\n");
+			return false;
+		}
+	}
+	else if (!header){
+		printf("%s has no header, so its size has to be given with --volume-size\n", options.volume.c_str());
+		return false;
+	}
+	if (options.voxelType == "float"){
+		info.type = VoxelFloat;
+	}
+	else if (options.voxelType == "uint16"){
+		info.type = VoxelUint16;
+	}
+	else if (!options.voxelType.empty()){
+		printf("Voxel type must be float or uint16\n");
+		return false;
+	}
+	if (info.size[0] <= 0 || info.size[1] <= 0 || info.size[2] <= 0){
+		printf("Volume size must be positive\n");
+		return false;
+	}
+	size_t needed = info.offset + (size_t)info.size[0] * info.size[1] * info.size[2] * (info.type == VoxelFloat ? 4 : 2);
+	if (file.size() < needed){
+		printf("Volume file is too small: %zu bytes, but %dx%dx%d %s voxels need %zu\n", file.size(), info.size[0], info.size[1], info.size[2],
+			info.type == VoxelFloat ? "float" : "uint16", needed);
+		return false;
+	}
+	return true;
+}
+
+// Prints the profile and writes the trace if one was asked for (builds with -DPROFILE only)
+void finishProfile([[maybe_unused]] const Options& options){
+#ifdef PROFILE
+	profiler.printSummary();
+	if (!options.traceFile.empty()){
+		profiler.writeTrace(options.traceFile);
+	}
+#endif
+}
+
+int main(int argc, char* argv[]){
+	// Todo: Command line args for step size, min, max, iso
+	Options options;
+	bool stepGiven = false;
+
+	try{
+		// Pull out the options (starting with --) so the positional arguments keep their order
+		std::vector<char*> args;
+		for (int i = 0; i < argc; i++){
+			if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc){
+				options.threads = std::stoi(argv[++i]);
+			}
+			else if (strcmp(argv[i], "--indexed") == 0){
+				options.indexed = true;
+			}
+			else if (strcmp(argv[i], "--binary") == 0){
+				options.plyFormat = BinaryLittleEndian;
+			}
+			else if (strcmp(argv[i], "--stream") == 0){
+				options.streamFile = true;
+			}
+			else if (strcmp(argv[i], "--generic") == 0){
+				options.generic = true;
+			}
+			else if (strcmp(argv[i], "--function") == 0 && i + 1 < argc){
+				options.function = argv[++i];
+			}
+			else if (strcmp(argv[i], "--expression") == 0 && i + 1 < argc){
+				options.expression = argv[++i];
+			}
+			else if (strcmp(argv[i], "--volume") == 0 && i + 1 < argc){
+				options.volume = argv[++i];
+			}
+			else if (strcmp(argv[i], "--volume-size") == 0 && i + 1 < argc){
+				options.volumeSize = argv[++i];
+			}
+			else if (strcmp(argv[i], "--voxel-type") == 0 && i + 1 < argc){
+				options.voxelType = argv[++i];
+			}
+			else if (strcmp(argv[i], "--error") == 0 && i + 1 < argc){
+				options.adaptiveError = std::stof(argv[++i]);
+			}
+			else if (strcmp(argv[i], "--brick") == 0 && i + 1 < argc){
+				options.brickSize = std::stoi(argv[++i]);
+			}
+			else if (strcmp(argv[i], "--interpolate") == 0){
+				options.interpolate = true;
+			}
+			else if (strcmp(argv[i], "--measure") == 0){
+				options.measureError = true;
+			}
+			else if (strcmp(argv[i], "--gradient-normals") == 0){
+				options.gradientNormals = true;
+			}
+			else if (strcmp(argv[i], "--batch") == 0){
+				options.batch = true;
+			}
+			else if (strcmp(argv[i], "--retain") == 0){
+				options.retain = true;
+			}
+			else if (strcmp(argv[i], "--benchmark") == 0){
+				options.benchmark = true;
+			}
+			else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc){
+				options.traceFile = argv[++i];
+			}
+			else if (strncmp(argv[i], "--", 2) == 0){
+				printf("Unknown option: %s\n", argv[i]);
+				return -1;
+			}
+			else{
+				args.push_back(argv[i]);
+			}
+		}
+		argc = args.size();
+		argv = args.data();
+
+		if (argc > 1){
+			options.filename = argv[1];
+		}
+		else{
+			options.generateFile = false;
+		}
+		if (argc > 2){
+			options.min = std::stof(argv[2]);
+			options.max = std::stof(argv[3]);
+		}
+		if (argc > 4){
+			options.step = std::stof(argv[4]);
+			stepGiven = true;
+		}
+		if (argc > 5){
+			options.isoval = std::stof(argv[5]);
+		}
+		if (argc > 6){
+			if (strcmp(argv[6], "f") == 0){
+				options.mode = Full;
+			}
+			else if (strcmp(argv[6], "x") == 0){
+				options.mode = Incremental_X;
+			}
+			else if (strcmp(argv[6], "y") == 0){
+				options.mode = Incremental_Y;
+			}
+			else if (strcmp(argv[6], "z") == 0){
+				options.mode = Incremental_Z;
+			}
+			else if (strcmp(argv[6], "a") == 0){
+				options.mode = Adaptive;
+			}
+			else if (strcmp(argv[6], "c") == 0){
+				options.mode = Chunked;
+			}
+			else{
+				printf("Mode must be one of: f, x, y, z, a, c\n");
+				return -1;
+			}
+		}
+	}
+	catch (...){
+		printf("Usage: as5 [--threads n] [--indexed] [--binary] [--stream] [--generic] [--function name] [--expression expr] [--volume file] [--volume-size NXxNYxNZ] [--voxel-type float|uint16] [--error e] [--brick b] [--interpolate] [--measure] [--gradient-normals] [--batch] [--retain] [--benchmark] [--trace file] filename min max step iso mode\n");
+		printf("min, max, step, iso, n, e, b must be numbers\n");
+		return -1;
+	}
+	if (options.max <= options.min){
+		printf("Max must be greater than min\n");
+		std::cout << options.max << " " << options.min;
+		return -1;
+	}
+	if (options.step <= 0){
+		printf("Step must be positive\n");
+		return -1;
+	}
+	if (options.threads <= 0){
+		printf("Thread count must be positive\n");
+		return -1;
+	}
+	if (options.adaptiveError <= 0){
+		printf("Adaptive error must be positive\n");
+		return -1;
+	}
+	if (options.brickSize <= 0){
+		printf("Brick size must be positive\n");
+		return -1;
+	}
+	if (options.retain && options.batch){
+		printf("--retain only works in the window. The samples won't be kept.\n");
+		options.retain = false;
+	}
+	if (options.retain){
+		if (options.mode == Adaptive || options.mode == Chunked){
+			printf("--retain needs every sample on the grid: generating in Full mode instead\n");
+			options.mode = Full;
+		}
+		if (options.streamFile){
+			// The file gets the mesh for the last iso value, so it's written when the window is closed
+			printf("--stream is ignored with --retain\n");
+			options.streamFile = false;
+		}
+		int points = Grid(options.min, options.max, options.step).points();
+		printf("Keeping %.0f MB of samples to change the iso value\n", pow(points, 3) * (sizeof(float) + 1) / 1e6);
+	}
+	if (options.mode == Chunked){
+		// The whole mesh is never kept, so the file has to be written as it is generated
+		options.streamFile = true;
+	}
+	if (options.function != "f" && options.function != "sphere" && options.function != "wave" && options.function != "tube"){
+		printf("Function must be one of: f, sphere, wave, tube\n");
+		return -1;
+	}
+	if ((options.function != "f") + !options.expression.empty() + !options.volume.empty() > 1){
+		printf("Use only one of --function, --expression and --volume\n");
+		return -1;
+	}
+	ExpressionFunction expression;
+	if (!options.expression.empty()){
+		std::string error;
+		if (!expression.compile(options.expression, error)){
+			printf("Error in expression: %s\n", error.c_str());
+			return -1;
+		}
+		printf("Compiled expression into %d instructions using %d registers\n", expression.getInstructionCount(), expression.getRegisterCount());
+	}
+	MappedFile volumeFile;
+	VolumeInfo volume;
+	if (!options.volume.empty()){
+		if (!openVolume(options, volumeFile, volume)){
+			return -1;
+		}
+		// Without a step, make one cube per voxel
+		int longest = std::max(std::max(volume.size[0], volume.size[1]), volume.size[2]);
+		if (!stepGiven){
+			options.step = (options.max - options.min) / std::max(longest - 1, 1);
+		}
+		printf("Volume of %dx%dx%d %s voxels, %.1f voxels per step\n", volume.size[0], volume.size[1], volume.size[2],
+			volume.type == VoxelFloat ? "float" : "uint16", options.step * std::max(longest - 1, 1) / (options.max - options.min));
+	}
+#ifdef PROFILE
+	if (!options.traceFile.empty()){
+		profiler.enableTrace();
+	}
+#else
+	if (!options.traceFile.empty()){
+		printf("--trace only works when compiled with -DPROFILE. No trace will be written.\n");
+	}
+#endif
+	if (options.benchmark){
+		int result = runBenchmark(options);
+		finishProfile(options);
+		return result;
+	}
+	if (!options.generateFile){
+		printf("No filename specified. No PLY file will be generated.\n");
+	}
+
+	if (options.batch && (options.mode == Incremental_X || options.mode == Incremental_Y || options.mode == Incremental_Z)){
+		// Slices are only there to show the mesh while it's generated, so use the faster Full mode
+		printf("Batch mode: generating in Full mode instead of slices\n");
+		options.mode = Full;
+	}
+
+	float slowness = (options.max - options.min) / options.step;
+	if (slowness > 300 && options.mode == Full && !options.batch){
+		printf("Warning: You picked Full mode with a very small step size and/or large mesh dimensions. Mesh generation will be slow and nothing will be shown until it is finished.\n");
+	}
+
+	int result;
+	if (!options.expression.empty())
+		result = run(expression, options);
+	else if (!options.volume.empty() && volume.type == VoxelFloat)
+		result = run(VolumeFunction<float>(volumeFile.data() + volume.offset, volume.size, options.min, options.max), options);
+	else if (!options.volume.empty())
+		result = run(VolumeFunction<uint16_t>(volumeFile.data() + volume.offset, volume.size, options.min, options.max), options);
+	else if (options.function == "sphere")
+		result = run(SphereFunction(), options);
+	else if (options.function == "wave")
+		result = run(WaveFunction(), options);
+	else if (options.function == "tube")
+		result = run(TubeFunction(), options);
+	else
+		result = run(SurfaceFunction(), options);
+	finishProfile(options);
+	return result;
+}
@@ -7,9 +7,12 @@ layout(location = 1) in vec3 vertexNormal;\n\
 out vec3 normal;\n\
 out vec3 eye_direction;\n\
 out vec3 light_direction;\n\
+// Values that change every frame, from a uniform buffer.\n\
+layout(std140) uniform Frame {\n\
+	mat4 MVP;\n\
+	mat4 V;\n\
+};\n\
 // Values that stay constant for the whole mesh.\n\
-uniform mat4 MVP;\n\
-uniform mat4 V;\n\
 uniform vec3 lightDir;\n\
 void main(){ \n\
 	// Output position of the vertex, in clip space : MVP * position\n\
@@ -39,4 +42,27 @@ void main() {\n\
 	float cosTheta = clamp(dot(n, l), 0, 1);\n\
 	float cosAlpha = clamp(dot(e, r), 0, 1);\n\
 	color = ambient + (modelColor * cosTheta) + (specular * pow(cosAlpha, alpha));\n\
-}\n\0";
\ No newline at end of file
+}\n\0";
+
+// Coloured lines for the axes and box
+char const *lineVertexShader = "\
+#version 330 core\n\
+layout(location = 0) in vec3 vertexPosition;\n\
+layout(location = 1) in vec3 vertexColor;\n\
+out vec3 color;\n\
+layout(std140) uniform Frame {\n\
+	mat4 MVP;\n\
+	mat4 V;\n\
+};\n\
+void main(){\n\
+	gl_Position = MVP * vec4(vertexPosition, 1);\n\
+	color = vertexColor;\n\
+}\n\0";
+
+char const *lineFragmentShader = "\
+#version 330 core\n\
+in vec3 color;\n\
+out vec4 fragColor;\n\
+void main() {\n\
+	fragColor = vec4(color, 1);\n\
+}\n\0";